@@ -3,6 +3,19 @@ if (!istable(query)) then
 end
 
 query.EnableInfoDetour(true)
+-- reuse the A2S_INFO hook result for 1 second, one reply per /24
+query.SetInfoHookCacheTime(1)
+query.SetInfoHookVariantPrefix(24)
+
+-- A2S_PLAYER challenges are on by default, A2S_INFO ones follow the 2020 protocol update
+query.EnableInfoChallenge(true)
+
+-- 2 queries per second per address with bursts of up to 10, rates can be fractional
+-- (0.5 is one query every 2 seconds) and a rate of 0 disables that limit
+query.EnableQueryLimiter(true)
+query.SetInfoRateLimit(2, 10)
+query.SetPlayerRateLimit(2, 10)
+query.SetGlobalMaxQueriesPerSecond(500)
 
 print("Detour enabled")
 hook.Add("A2S_INFO", "reply", function(ip, port, info)
@@ -23,3 +36,58 @@ hook.Add("A2S_PLAYER", "reply", function(ip, port, info)
 		{name = "DUCKS3", score = 1, time = 3},
     }
 end)
+
+query.EnableRulesDetour(true)
+query.SetRulesConVars({"sv_gravity", "sv_allowcslua"})
+
+hook.Add("A2S_RULES", "reply", function(ip, port, rules)
+    rules.sv_gravity = "400"
+
+    return rules
+end)
+
+-- A2S_PLAYER straight from the engine's client list, the A2S_PLAYER hook isn't called
+query.EnableNativePlayerReply(true)
+query.SetPlayerSnapshotInterval(1)
+query.SetPlayerOverride(function(index, name, score, time)
+    if name == "hidden" then
+        return false
+    end
+
+    return name, score, time
+end)
+
+-- answer queries on a dedicated port with 4 threads (Linux only), the game port keeps working
+-- every /16 is always answered by the same thread so address and subnet limits hold across
+-- threads, but the game port counts them separately: a client querying both ports gets a budget
+-- on each
+query.StartQueryWorkers(27016, 4)
+
+-- limit whole subnets too and ban a /24 or /16 for 5 minutes once it gets 100 queries
+-- rejected within a second
+query.SetSubnetRateLimit(24, 20, 60)
+query.SetSubnetRateLimit(16, 100, 300)
+query.SetPrefixAutoBan(100, 300)
+
+-- counters since the last ResetStats, latencies are in microseconds
+timer.Create("query_stats", 60, 0, function()
+    local stats = query.GetStats()
+    print("packets", stats.packets_received, "dropped", stats.packets_dropped, "rate limited", stats.rate_limited)
+    print("hook p99", stats.latency.hook.p99, "send p99", stats.latency.send.p99)
+    query.ResetStats()
+end)
+
+-- push the same counters as StatsD lines to a local agent every 10 seconds
+query.StartStatsExporter("127.0.0.1", 8125, 10, "gmod.query")
+
+-- keep 1 in 100 A2S_INFO packets and every packet the classifier dropped, then write
+-- them to garrysmod/data/query/samples.pcap (opens in Wireshark)
+query.SetPacketSampling(100, {"info", "invalid"})
+timer.Simple(60, function()
+    for _, packet in ipairs(query.GetSamplePackets()) do
+        print(packet.time, packet.ip, packet.port, packet.type, packet.passed, packet.length)
+    end
+
+    file.CreateDir("query")
+    query.DumpPcap("query/samples.pcap")
+end)
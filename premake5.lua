@@ -24,3 +24,36 @@ files({
 	"source/netfilter/*.cpp",
 	"source/netfilter/*.hpp"
 })
+
+-- offline benchmarks, built from the netfilter sources against the stand-ins in
+-- source/bench/include so they run without a server or the SDK
+local bench_files = {
+	"source/bench/bench.cpp",
+	"source/bench/bench.hpp",
+	"source/netfilter/client.cpp",
+	"source/netfilter/clientmanager.cpp",
+	"source/netfilter/challenge.cpp",
+	"source/netfilter/serializer.cpp"
+}
+
+project("query_replay")
+kind("ConsoleApp")
+language("C++")
+cppdialect("C++17")
+includedirs({"source/bench/include", "source/netfilter", "source"})
+files(bench_files)
+files({"source/bench/replay.cpp"})
+filter("system:windows")
+links({"ws2_32"})
+filter({})
+
+project("query_micro")
+kind("ConsoleApp")
+language("C++")
+cppdialect("C++17")
+includedirs({"source/bench/include", "source/netfilter", "source"})
+files(bench_files)
+files({"source/bench/runner.cpp", "source/bench/runner.hpp", "source/bench/micro.cpp"})
+filter("system:windows")
+links({"ws2_32"})
+filter({})
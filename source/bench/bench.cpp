@@ -0,0 +1,95 @@
+#include "bench.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+
+static std::atomic<uint64_t> allocations( 0 );
+
+void *operator new( size_t size )
+{
+	allocations.fetch_add( 1, std::memory_order_relaxed );
+	void *pointer = std::malloc( size != 0 ? size : 1 );
+	if( pointer == nullptr )
+		throw std::bad_alloc( );
+
+	return pointer;
+}
+
+void *operator new[]( size_t size )
+{
+	return operator new( size );
+}
+
+void operator delete( void *pointer ) noexcept
+{
+	std::free( pointer );
+}
+
+void operator delete[]( void *pointer ) noexcept
+{
+	std::free( pointer );
+}
+
+void operator delete( void *pointer, size_t ) noexcept
+{
+	std::free( pointer );
+}
+
+void operator delete[]( void *pointer, size_t ) noexcept
+{
+	std::free( pointer );
+}
+
+namespace bench
+{
+	uint64_t GetAllocations( )
+	{
+		return allocations.load( std::memory_order_relaxed );
+	}
+
+	netfilter::reply_info_t MakeReplyInfo( int32_t players )
+	{
+		netfilter::reply_info_t info;
+		info.game_name = "Garry's Mod";
+		info.map_name = "gm_construct";
+		info.game_dir = "garrysmod";
+		info.gamemode_name = "Sandbox";
+		info.amt_clients = players;
+		info.max_clients = players > 128 ? players : 128;
+		info.amt_bots = 0;
+		info.server_type = 'd';
+		info.os_type = 'l';
+		info.passworded = false;
+		info.secure = true;
+		info.game_version = "2024.09.05";
+		info.udp_port = 27015;
+		info.tags = " gm:sandbox gmc:other ver:240905 loc:us";
+		info.appid = 4000;
+		info.steamid = 90071996842377216ULL;
+		return info;
+	}
+
+	const std::vector<std::string> &GetPlayerNames( )
+	{
+		static std::vector<std::string> names;
+		if( names.empty( ) )
+		{
+			std::mt19937 random( 1 );
+			std::uniform_int_distribution<int32_t> length( 3, 31 );
+			std::uniform_int_distribution<int32_t> letter( 'a', 'z' );
+			for( size_t k = 0; k < 255; ++k )
+			{
+				std::string name( static_cast<size_t>( length( random ) ), ' ' );
+				for( char &c : name )
+					c = static_cast<char>( letter( random ) );
+
+				names.emplace_back( std::move( name ) );
+			}
+		}
+
+		return names;
+	}
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "serializer.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace bench
+{
+	// operator new calls since the program started
+	uint64_t GetAllocations( );
+
+	inline uint64_t GetTimeNanoseconds( )
+	{
+		return static_cast<uint64_t>( std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now( ).time_since_epoch( )
+		).count( ) );
+	}
+
+	// keeps the compiler from dropping a result nobody reads
+	template<typename T>
+	inline void DoNotOptimize( const T &value )
+	{
+
+#if defined _MSC_VER
+
+		static volatile const void *sink = nullptr;
+		sink = &value;
+
+#else
+
+		asm volatile( "" : : "g"( &value ) : "memory" );
+
+#endif
+
+	}
+
+	// what a typical Garry's Mod server answers A2S_INFO with
+	netfilter::reply_info_t MakeReplyInfo( int32_t players );
+
+	// player names of realistic lengths
+	const std::vector<std::string> &GetPlayerNames( );
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+// stand-in, nothing in the benchmarks loads interfaces
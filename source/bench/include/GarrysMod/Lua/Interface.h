@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstring>
+#include <utility>
+#include <vector>
+
+// stand-in for garrysmod_common's ILuaBase with just the calls the serializers make,
+// values live in plain C++ tables built by the benchmark
+namespace GarrysMod
+{
+	namespace Lua
+	{
+		namespace Type
+		{
+			enum
+			{
+				None = -1,
+				Nil,
+				Bool,
+				LightUserData,
+				Number,
+				String,
+				Table
+			};
+		}
+
+		struct table_t;
+
+		struct value_t
+		{
+			int type;
+			double number;
+			bool boolean;
+			const char *string;
+			const table_t *table;
+
+			static value_t Nil( )
+			{
+				return { Type::Nil, 0.0, false, nullptr, nullptr };
+			}
+
+			static value_t Number( double number )
+			{
+				return { Type::Number, number, false, nullptr, nullptr };
+			}
+
+			static value_t Boolean( bool boolean )
+			{
+				return { Type::Bool, 0.0, boolean, nullptr, nullptr };
+			}
+
+			static value_t String( const char *string )
+			{
+				return { Type::String, 0.0, false, string, nullptr };
+			}
+
+			static value_t Table( const table_t *table )
+			{
+				return { Type::Table, 0.0, false, nullptr, table };
+			}
+		};
+
+		// string keys are looked up linearly, integer keys index the array part
+		struct table_t
+		{
+			std::vector<std::pair<const char *, value_t>> fields;
+			std::vector<value_t> array;
+
+			value_t Get( const char *key ) const
+			{
+				for( const auto &field : fields )
+					if( std::strcmp( field.first, key ) == 0 )
+						return field.second;
+
+				return value_t::Nil( );
+			}
+
+			value_t Get( double key ) const
+			{
+				const size_t index = static_cast<size_t>( key );
+				return index >= 1 && index <= array.size( ) ? array[index - 1] : value_t::Nil( );
+			}
+		};
+
+		class ILuaBase
+		{
+		public:
+			ILuaBase( ) :
+				top( 0 )
+			{ }
+
+			void Push( const value_t &value )
+			{
+				stack[top++] = value;
+			}
+
+			int Top( )
+			{
+				return top;
+			}
+
+			void Pop( int amount = 1 )
+			{
+				top -= amount;
+			}
+
+			bool IsType( int index, int type )
+			{
+				return At( index ).type == type;
+			}
+
+			double GetNumber( int index = -1 )
+			{
+				return At( index ).number;
+			}
+
+			bool GetBool( int index = -1 )
+			{
+				return At( index ).boolean;
+			}
+
+			const char *GetString( int index = -1, unsigned int *length = nullptr )
+			{
+				const char *string = At( index ).string;
+				if( length != nullptr )
+					*length = static_cast<unsigned int>( std::strlen( string ) );
+
+				return string;
+			}
+
+			void PushNumber( double number )
+			{
+				Push( value_t::Number( number ) );
+			}
+
+			void GetField( int index, const char *key )
+			{
+				const value_t &table = At( index );
+				Push( table.table != nullptr ? table.table->Get( key ) : value_t::Nil( ) );
+			}
+
+			// pops the key like lua_gettable, only number keys are supported
+			void GetTable( int index )
+			{
+				const value_t table = At( index );
+				const double key = At( -1 ).number;
+				Pop( 1 );
+				Push( table.table != nullptr ? table.table->Get( key ) : value_t::Nil( ) );
+			}
+
+			int ObjLen( int index = -1 )
+			{
+				const value_t &table = At( index );
+				return table.table != nullptr ? static_cast<int>( table.table->array.size( ) ) : 0;
+			}
+
+		private:
+			const value_t &At( int index ) const
+			{
+				return stack[index < 0 ? top + index : index - 1];
+			}
+
+			value_t stack[64];
+			int top;
+		};
+	}
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+// stand-in for the SDK's bf_write, A2S replies only use byte aligned writes
+class bf_write
+{
+public:
+	bf_write( void *data, int bytes ) :
+		data( static_cast<unsigned char *>( data ) ), size( bytes ), written( 0 ), overflowed( false )
+	{ }
+
+	void Reset( )
+	{
+		written = 0;
+		overflowed = false;
+	}
+
+	void WriteByte( int value )
+	{
+		const uint8_t byte = static_cast<uint8_t>( value );
+		Write( &byte, sizeof( byte ) );
+	}
+
+	void WriteShort( int value )
+	{
+		const int16_t word = static_cast<int16_t>( value );
+		Write( &word, sizeof( word ) );
+	}
+
+	void WriteLong( long value )
+	{
+		const int32_t dword = static_cast<int32_t>( value );
+		Write( &dword, sizeof( dword ) );
+	}
+
+	void WriteLongLong( int64_t value )
+	{
+		Write( &value, sizeof( value ) );
+	}
+
+	void WriteFloat( float value )
+	{
+		Write( &value, sizeof( value ) );
+	}
+
+	bool WriteString( const char *str )
+	{
+		Write( str, std::strlen( str ) + 1 );
+		return !overflowed;
+	}
+
+	unsigned char *GetData( )
+	{
+		return data;
+	}
+
+	const unsigned char *GetData( ) const
+	{
+		return data;
+	}
+
+	int GetNumBytesWritten( ) const
+	{
+		return written;
+	}
+
+	bool IsOverflowed( ) const
+	{
+		return overflowed;
+	}
+
+private:
+	void Write( const void *value, size_t len )
+	{
+		if( written + static_cast<int>( len ) > size )
+		{
+			overflowed = true;
+			return;
+		}
+
+		std::memcpy( data + written, value, len );
+		written += static_cast<int>( len );
+	}
+
+	unsigned char *data;
+	int size;
+	int written;
+	bool overflowed;
+};
@@ -0,0 +1,237 @@
+#include "bench.hpp"
+#include "runner.hpp"
+
+#include "clientmanager.hpp"
+#include "serializer.hpp"
+
+#include <GarrysMod/Lua/Interface.h>
+#include <bitbuf.h>
+
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+// microbenchmarks of the rate limiter and the A2S serializers, run with
+// --benchmark_out=results.json to keep results to diff against another build
+
+using namespace netfilter;
+
+namespace
+{
+	static const uint64_t start_time = 1000000000000ULL;
+
+	static std::vector<uint32_t> MakeAddresses( size_t count, uint32_t seed )
+	{
+		std::mt19937 random( seed );
+		std::vector<uint32_t> addresses( count );
+		for( uint32_t &address : addresses )
+			address = static_cast<uint32_t>( random( ) );
+
+		return addresses;
+	}
+
+	// generous limits so the benchmark measures lookups and not rejections
+	static void SetupManager( ClientManager &manager, bool subnets )
+	{
+		manager.SetState( true );
+		manager.SetRateLimit( QueryType::Info, 1000000, 1000000 );
+		manager.SetGlobalMaxQueriesPerSecond( 1000000 );
+		if( subnets )
+		{
+			manager.SetSubnetRateLimit( 24, 1000000, 1000000 );
+			manager.SetSubnetRateLimit( 16, 1000000, 1000000 );
+		}
+	}
+
+	// cycles through addresses, one microsecond apart
+	static void CheckIPRate( bench::State &state, const std::vector<uint32_t> &addresses, bool subnets )
+	{
+		std::unique_ptr<ClientManager> manager( new ClientManager( ) );
+		SetupManager( *manager, subnets );
+		std::unique_ptr<ClientShard> shard( new ClientShard( *manager ) );
+
+		const size_t mask = addresses.size( ) - 1;
+		uint64_t time = start_time;
+		size_t index = 0;
+		size_t passed = 0;
+		while( state.KeepRunning( ) )
+		{
+			passed += shard->CheckIPRate( addresses[index & mask], QueryType::Info, time ) ? 1 : 0;
+			++index;
+			++time;
+		}
+
+		bench::DoNotOptimize( passed );
+	}
+
+	// every address is new to a table that is already full, so each one evicts a client,
+	// either a still active one or one that timed out long ago
+	static void CheckIPRateFullTable( bench::State &state, bool timed_out )
+	{
+		std::unique_ptr<ClientManager> manager( new ClientManager( ) );
+		SetupManager( *manager, false );
+		std::unique_ptr<ClientShard> shard( new ClientShard( *manager ) );
+
+		const std::vector<uint32_t> fill = MakeAddresses( ClientShard::MaxClients * 4, 10 );
+		uint64_t time = start_time;
+		for( const uint32_t address : fill )
+			shard->CheckIPRate( address, QueryType::Info, time++ );
+
+		if( timed_out )
+			time += ClientManager::ClientTimeout + 1;
+
+		const std::vector<uint32_t> addresses = MakeAddresses( 1 << 20, 11 );
+		const size_t mask = addresses.size( ) - 1;
+		size_t index = 0;
+		size_t passed = 0;
+		while( state.KeepRunning( ) )
+		{
+			passed += shard->CheckIPRate( addresses[index & mask], QueryType::Info, time ) ? 1 : 0;
+			++index;
+
+			// without time moving clients never time out
+			if( !timed_out )
+				++time;
+		}
+
+		bench::DoNotOptimize( passed );
+	}
+
+	static void WriteNativeInfo( bench::State &state )
+	{
+		const reply_info_t info = bench::MakeReplyInfo( 32 );
+		char buffer[1024];
+		bf_write packet( buffer, sizeof( buffer ) );
+		while( state.KeepRunning( ) )
+		{
+			packet.Reset( );
+			WriteInfoReply( packet, info );
+			bench::DoNotOptimize( buffer );
+		}
+
+		state.SetCounter( "bytes", packet.GetNumBytesWritten( ) );
+	}
+
+	static void PatchInfo( bench::State &state )
+	{
+		reply_info_t info = bench::MakeReplyInfo( 32 );
+		char buffer[1024];
+		bf_write packet( buffer, sizeof( buffer ) );
+		info_offsets_t offsets = { };
+		WriteInfoReply( packet, info, &offsets );
+		while( state.KeepRunning( ) )
+		{
+			info.amt_clients = ( info.amt_clients + 1 ) & 127;
+			PatchInfoReply( packet, offsets, info );
+			bench::DoNotOptimize( buffer );
+		}
+	}
+
+	static void WriteLuaInfo( bench::State &state )
+	{
+		const reply_info_t defaults = bench::MakeReplyInfo( 32 );
+		GarrysMod::Lua::table_t table;
+		table.fields = {
+			{ "name", GarrysMod::Lua::value_t::String( "Garry's Mod" ) },
+			{ "map", GarrysMod::Lua::value_t::String( "gm_flatgrass" ) },
+			{ "players", GarrysMod::Lua::value_t::Number( 100 ) },
+			{ "tags", GarrysMod::Lua::value_t::String( " gm:sandbox gmc:other" ) }
+		};
+
+		GarrysMod::Lua::ILuaBase lua;
+		lua.Push( GarrysMod::Lua::value_t::Table( &table ) );
+
+		char buffer[1024];
+		bf_write packet( buffer, sizeof( buffer ) );
+		while( state.KeepRunning( ) )
+		{
+			packet.Reset( );
+			WriteInfoReply( packet, &lua, -1, defaults );
+			bench::DoNotOptimize( buffer );
+		}
+	}
+
+	static void WriteNativePlayers( bench::State &state, int32_t players )
+	{
+		const std::vector<std::string> &names = bench::GetPlayerNames( );
+		char buffer[16384];
+		bf_write packet( buffer, sizeof( buffer ) );
+		while( state.KeepRunning( ) )
+		{
+			packet.Reset( );
+			WritePlayerReplyHeader( packet );
+			for( int32_t k = 0; k < players; ++k )
+				WritePlayerReplyEntry(
+					packet,
+					static_cast<uint8_t>( k ),
+					names[static_cast<size_t>( k )].c_str( ),
+					k,
+					60.0 * k
+				);
+
+			WritePlayerReplyCount( packet, static_cast<uint8_t>( players ) );
+			bench::DoNotOptimize( buffer );
+		}
+
+		state.SetCounter( "bytes", packet.GetNumBytesWritten( ) );
+	}
+
+	static void WriteLuaPlayers( bench::State &state, int32_t players )
+	{
+		const std::vector<std::string> &names = bench::GetPlayerNames( );
+		std::vector<GarrysMod::Lua::table_t> entries( static_cast<size_t>( players ) );
+		GarrysMod::Lua::table_t table;
+		for( size_t k = 0; k < entries.size( ); ++k )
+		{
+			entries[k].fields = {
+				{ "name", GarrysMod::Lua::value_t::String( names[k].c_str( ) ) },
+				{ "score", GarrysMod::Lua::value_t::Number( static_cast<double>( k ) ) },
+				{ "time", GarrysMod::Lua::value_t::Number( 60.0 * static_cast<double>( k ) ) }
+			};
+			table.array.push_back( GarrysMod::Lua::value_t::Table( &entries[k] ) );
+		}
+
+		GarrysMod::Lua::ILuaBase lua;
+		lua.Push( GarrysMod::Lua::value_t::Table( &table ) );
+
+		char buffer[16384];
+		bf_write packet( buffer, sizeof( buffer ) );
+		while( state.KeepRunning( ) )
+		{
+			packet.Reset( );
+			WritePlayerReply( packet, &lua, -1 );
+			bench::DoNotOptimize( buffer );
+		}
+	}
+}
+
+int main( int argc, char **argv )
+{
+	// powers of two so the address loops can mask
+	static const std::vector<uint32_t> single( 1, 0x7F000001 );
+	static const std::vector<uint32_t> clients = MakeAddresses( ClientShard::MaxClients, 1 );
+	static const std::vector<uint32_t> spoofed = MakeAddresses( 1 << 20, 2 );
+
+	bench::Runner runner;
+	runner.Register( "CheckIPRate/single_ip", []( bench::State &state ) { CheckIPRate( state, single, false ); } );
+	runner.Register( "CheckIPRate/4096_ips", []( bench::State &state ) { CheckIPRate( state, clients, false ); } );
+	runner.Register( "CheckIPRate/random_spoofed", []( bench::State &state ) { CheckIPRate( state, spoofed, false ); } );
+	runner.Register( "CheckIPRate/random_spoofed_subnets", []( bench::State &state ) { CheckIPRate( state, spoofed, true ); } );
+	runner.Register( "CheckIPRate/full_table_evict_active", []( bench::State &state ) { CheckIPRateFullTable( state, false ); } );
+	runner.Register( "CheckIPRate/full_table_evict_timed_out", []( bench::State &state ) { CheckIPRateFullTable( state, true ); } );
+
+	runner.Register( "WriteInfoReply/native", WriteNativeInfo );
+	runner.Register( "WriteInfoReply/lua", WriteLuaInfo );
+	runner.Register( "PatchInfoReply", PatchInfo );
+
+	for( const int32_t players : { 0, 32, 128 } )
+	{
+		const std::string count = std::to_string( players );
+		runner.Register( "WritePlayerReply/native/" + count, [players]( bench::State &state ) { WriteNativePlayers( state, players ); } );
+		runner.Register( "WritePlayerReply/lua/" + count, [players]( bench::State &state ) { WriteLuaPlayers( state, players ); } );
+	}
+
+	return runner.Run( argc, argv );
+}
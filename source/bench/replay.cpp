@@ -0,0 +1,674 @@
+#include "bench.hpp"
+
+#include "clientmanager.hpp"
+#include "challenge.hpp"
+#include "packet.hpp"
+#include "serializer.hpp"
+
+#include <GarrysMod/Lua/Interface.h>
+#include <bitbuf.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined _WIN32
+
+#include <WinSock2.h>
+
+#else
+
+#include <arpa/inet.h>
+
+#endif
+
+// replays a packet trace through the same code the receiver thread runs for every packet
+// (header parsing, bans, challenges, rate limits) and serializes the replies the main
+// thread would build, one stage at a time over the whole trace so timing a stage doesn't
+// disturb the others
+
+using namespace netfilter;
+
+namespace
+{
+	// arbitrary, challenges rotate every 30 seconds from here
+	static const uint64_t trace_start = 1000000000000ULL;
+
+	struct trace_packet_t
+	{
+		uint32_t address; // network byte order
+		uint64_t time; // microseconds
+		size_t offset;
+		int32_t length;
+	};
+
+	struct trace_t
+	{
+		std::vector<trace_packet_t> packets;
+		std::vector<uint8_t> bytes;
+
+		void Add( uint32_t address, uint64_t time, const void *data, size_t len )
+		{
+			packets.push_back( { address, trace_start + time, bytes.size( ), static_cast<int32_t>( len ) } );
+			const uint8_t *begin = static_cast<const uint8_t *>( data );
+			bytes.insert( bytes.end( ), begin, begin + len );
+		}
+
+		void Sort( )
+		{
+			std::stable_sort(
+				packets.begin( ),
+				packets.end( ),
+				[]( const trace_packet_t &a, const trace_packet_t &b ) { return a.time < b.time; }
+			);
+		}
+
+		const uint8_t *GetData( const trace_packet_t &packet ) const
+		{
+			return bytes.data( ) + packet.offset;
+		}
+	};
+
+	struct options_t
+	{
+		std::string trace = "mixed";
+		std::string pcap;
+		uint16_t port = 0;
+		size_t packets = 1000000;
+		size_t iterations = 5;
+		int32_t players = 32;
+		bool lua = false;
+		bool limiter = true;
+		query_policy_t policy; // the module's defaults
+	};
+
+	static ChallengeManager challenge_manager;
+
+	// A2S requests as clients send them, challenges are appended when there is one
+
+	static void AddInfoQuery( trace_t &trace, uint32_t address, uint64_t time, const uint32_t *challenge )
+	{
+		uint8_t packet[29] = { 0xFF, 0xFF, 0xFF, 0xFF, 'T' };
+		std::memcpy( packet + 5, "Source Engine Query", 20 );
+		size_t len = info_challenge_offset;
+		if( challenge != nullptr )
+		{
+			std::memcpy( packet + len, challenge, sizeof( *challenge ) );
+			len += sizeof( *challenge );
+		}
+
+		trace.Add( address, time, packet, len );
+	}
+
+	static void AddChallengedQuery( trace_t &trace, uint8_t type, uint32_t address, uint64_t time, uint32_t challenge )
+	{
+		uint8_t packet[9] = { 0xFF, 0xFF, 0xFF, 0xFF, type };
+		std::memcpy( packet + 5, &challenge, sizeof( challenge ) );
+		trace.Add( address, time, packet, sizeof( packet ) );
+	}
+
+	static uint32_t GetChallenge( uint32_t address, uint64_t time )
+	{
+		return challenge_manager.GetChallenge( address, trace_start + time );
+	}
+
+	// a server browser refresh, one client at a time goes through the whole handshake
+	static void AddBrowserClient( trace_t &trace, uint32_t address, uint64_t time, std::mt19937 &random )
+	{
+		std::uniform_int_distribution<uint64_t> rtt( 10000, 200000 );
+		const uint64_t delay = rtt( random );
+		AddInfoQuery( trace, address, time, nullptr );
+
+		const uint32_t challenge = GetChallenge( address, time + delay );
+		AddInfoQuery( trace, address, time + delay, &challenge );
+		AddChallengedQuery( trace, 'U', address, time + delay, 0xFFFFFFFF );
+		AddChallengedQuery( trace, 'U', address, time + delay * 2, challenge );
+		AddChallengedQuery( trace, 'V', address, time + delay * 3, challenge );
+	}
+
+	static uint32_t RandomAddress( std::mt19937 &random )
+	{
+		return htonl( static_cast<uint32_t>( random( ) ) );
+	}
+
+	// spoofed A2S_INFO from uniformly random sources, a million per second
+	static void BuildFloodTrace( trace_t &trace, size_t count )
+	{
+		std::mt19937 random( 1 );
+		for( size_t k = 0; k < count; ++k )
+			AddInfoQuery( trace, RandomAddress( random ), k, nullptr );
+	}
+
+	// a few thousand browsers refreshing every second
+	static void BuildBrowserTrace( trace_t &trace, size_t count )
+	{
+		std::mt19937 random( 2 );
+		for( size_t k = 0; trace.packets.size( ) < count; ++k )
+			AddBrowserClient( trace, RandomAddress( random ), k * 200, random );
+
+		trace.Sort( );
+		trace.packets.resize( count );
+	}
+
+	// players in the server sending netchannel packets every tick, browsers, connection
+	// attempts and the occasional garbage
+	static void BuildMixedTrace( trace_t &trace, size_t count, int32_t players )
+	{
+		std::mt19937 random( 3 );
+		std::vector<uint32_t> addresses;
+		for( int32_t k = 0; k < players; ++k )
+			addresses.push_back( RandomAddress( random ) );
+
+		std::uniform_int_distribution<size_t> size( 40, 400 );
+		std::uniform_int_distribution<int32_t> percent( 0, 99 );
+		uint8_t packet[400] = { };
+		int32_t sequence = 1;
+		for( uint64_t tick = 0; trace.packets.size( ) < count; ++tick )
+		{
+			const uint64_t time = tick * 15151; // 66 ticks per second
+			for( const uint32_t address : addresses )
+			{
+				const size_t len = size( random );
+				std::memcpy( packet, &sequence, sizeof( sequence ) );
+				for( size_t k = 4; k < len; ++k )
+					packet[k] = static_cast<uint8_t>( random( ) );
+
+				trace.Add( address, time, packet, len );
+				++sequence;
+			}
+
+			const int32_t roll = percent( random );
+			if( roll < 40 )
+			{
+				AddBrowserClient( trace, RandomAddress( random ), time, random );
+			}
+			else if( roll < 45 )
+			{
+				const uint8_t connect[] = { 0xFF, 0xFF, 0xFF, 0xFF, 'q', '0', '0', '0', '0', '0', '0', '0', '0', 0 };
+				trace.Add( RandomAddress( random ), time, connect, sizeof( connect ) );
+			}
+			else if( roll < 47 )
+			{
+				const uint8_t split[] = { 0xFE, 0xFF, 0xFF, 0xFF, 0, 0, 0, 0, 0, 0 };
+				trace.Add( RandomAddress( random ), time, split, sizeof( split ) );
+			}
+		}
+
+		trace.Sort( );
+		trace.packets.resize( count );
+	}
+
+	template<typename T>
+	static bool Read( FILE *file, T &value )
+	{
+		return std::fread( &value, sizeof( value ), 1, file ) == 1;
+	}
+
+	// UDP over IPv4 from classic pcap files (Ethernet, raw IP or Linux cooked captures),
+	// when port isn't 0 only packets sent to it are kept
+	static bool LoadPcapTrace( trace_t &trace, const std::string &path, uint16_t port )
+	{
+		FILE *file = std::fopen( path.c_str( ), "rb" );
+		if( file == nullptr )
+		{
+			std::fprintf( stderr, "unable to open %s\n", path.c_str( ) );
+			return false;
+		}
+
+		uint32_t magic = 0;
+		uint8_t header[20] = { };
+		if( !Read( file, magic ) || std::fread( header, sizeof( header ), 1, file ) != 1 )
+		{
+			std::fclose( file );
+			return false;
+		}
+
+		const bool nanoseconds = magic == 0xA1B23C4D;
+		if( magic != 0xA1B2C3D4 && !nanoseconds )
+		{
+			std::fprintf( stderr, "%s isn't a little endian pcap file\n", path.c_str( ) );
+			std::fclose( file );
+			return false;
+		}
+
+		uint32_t linktype = 0;
+		std::memcpy( &linktype, header + 16, sizeof( linktype ) );
+		size_t link_header = 0;
+		if( linktype == 1 )
+			link_header = 14;
+		else if( linktype == 113 )
+			link_header = 16;
+		else if( linktype == 276 )
+			link_header = 20;
+		else if( linktype != 101 && linktype != 228 )
+		{
+			std::fprintf( stderr, "unsupported pcap link type %u\n", linktype );
+			std::fclose( file );
+			return false;
+		}
+
+		std::vector<uint8_t> record;
+		uint64_t first = 0;
+		uint32_t seconds = 0, fraction = 0, captured = 0, length = 0;
+		while( Read( file, seconds ) && Read( file, fraction ) && Read( file, captured ) && Read( file, length ) )
+		{
+			record.resize( captured );
+			if( captured != 0 && std::fread( record.data( ), captured, 1, file ) != 1 )
+				break;
+
+			size_t offset = link_header;
+			if( linktype == 1 && captured >= 18 && record[12] == 0x81 && record[13] == 0x00 )
+				offset += 4; // 802.1Q
+
+			if( captured < offset + 28 || ( record[offset] >> 4 ) != 4 || record[offset + 9] != 17 )
+				continue;
+
+			const size_t ip_header = static_cast<size_t>( record[offset] & 0x0F ) * 4;
+			const size_t udp = offset + ip_header;
+			if( captured < udp + 8 )
+				continue;
+
+			const uint16_t destination = static_cast<uint16_t>( record[udp + 2] << 8 | record[udp + 3] );
+			if( port != 0 && destination != port )
+				continue;
+
+			uint32_t address = 0;
+			std::memcpy( &address, record.data( ) + offset + 12, sizeof( address ) );
+
+			const uint64_t time = static_cast<uint64_t>( seconds ) * 1000000 +
+				( nanoseconds ? fraction / 1000 : fraction );
+			if( trace.packets.empty( ) )
+				first = time;
+
+			trace.Add( address, time - first, record.data( ) + udp + 8, captured - udp - 8 );
+		}
+
+		std::fclose( file );
+		return !trace.packets.empty( );
+	}
+
+	enum class Verdict : uint8_t
+	{
+		Engine, // passed to the engine
+		Malformed,
+		Banned,
+		RateLimited,
+		Challenged,
+		Reply
+	};
+
+	struct stage_result_t
+	{
+		const char *name;
+		size_t packets;
+		uint64_t nanoseconds;
+		uint64_t allocations;
+	};
+
+	struct pipeline_t
+	{
+		pipeline_t( const options_t &options ) :
+			options( options ),
+			clients( manager ),
+			info( bench::MakeReplyInfo( options.players ) ),
+			packet( buffer, sizeof( buffer ) )
+		{
+			manager.SetState( options.limiter );
+			manager.SetGlobalMaxQueriesPerSecond( 500 );
+
+			info_table.fields = {
+				{ "name", GarrysMod::Lua::value_t::String( "Garry's Mod" ) },
+				{ "map", GarrysMod::Lua::value_t::String( "gm_flatgrass" ) },
+				{ "players", GarrysMod::Lua::value_t::Number( options.players ) },
+				{ "tags", GarrysMod::Lua::value_t::String( " gm:sandbox gmc:other" ) }
+			};
+
+			const std::vector<std::string> &names = bench::GetPlayerNames( );
+			player_tables.resize( static_cast<size_t>( options.players ) );
+			for( size_t k = 0; k < player_tables.size( ); ++k )
+			{
+				player_tables[k].fields = {
+					{ "name", GarrysMod::Lua::value_t::String( names[k].c_str( ) ) },
+					{ "score", GarrysMod::Lua::value_t::Number( static_cast<double>( k ) ) },
+					{ "time", GarrysMod::Lua::value_t::Number( 60.0 * static_cast<double>( k ) ) }
+				};
+				players_table.array.push_back( GarrysMod::Lua::value_t::Table( &player_tables[k] ) );
+			}
+
+			// a typical SetRulesConVars list, A2S_RULES hook results end up as the same pairs
+			rules = {
+				{ "sv_gravity", "600" },
+				{ "sv_friction", "8" },
+				{ "sv_accelerate", "10" },
+				{ "sv_airaccelerate", "10" },
+				{ "sv_allowcslua", "0" },
+				{ "sv_cheats", "0" },
+				{ "sv_noclipspeed", "5" },
+				{ "mp_friendlyfire", "0" },
+				{ "sbox_noclip", "1" },
+				{ "sbox_godmode", "0" },
+				{ "sbox_playershurtplayers", "1" },
+				{ "sbox_weapons", "1" }
+			};
+		}
+
+		void Run( const trace_t &trace, std::vector<stage_result_t> &results )
+		{
+			const size_t count = trace.packets.size( );
+			headers.assign( count, PacketHeader::Malformed );
+			verdicts.assign( count, Verdict::Engine );
+
+			results.clear( );
+			Measure( results, "classify", [&]( ) { return Classify( trace ); } );
+			Measure( results, "challenge", [&]( ) { return Challenge( trace ); } );
+			Measure( results, "rate_limit", [&]( ) { return RateLimit( trace ); } );
+			Measure( results, "serialize", [&]( ) { return Serialize( ); } );
+		}
+
+		template<typename Stage>
+		void Measure( std::vector<stage_result_t> &results, const char *name, Stage stage )
+		{
+			const uint64_t allocations = bench::GetAllocations( );
+			const uint64_t start = bench::GetTimeNanoseconds( );
+			const size_t packets = stage( );
+			const uint64_t end = bench::GetTimeNanoseconds( );
+			results.push_back( { name, packets, end - start, bench::GetAllocations( ) - allocations } );
+		}
+
+		// ClassifyPacket up to the point where queries are handed to their handlers
+		size_t Classify( const trace_t &trace )
+		{
+			for( size_t k = 0; k < trace.packets.size( ); ++k )
+			{
+				const trace_packet_t &p = trace.packets[k];
+				const PacketHeader header = ParsePacketHeader( trace.GetData( p ), p.length );
+				headers[k] = header;
+				if( header == PacketHeader::Malformed )
+					verdicts[k] = Verdict::Malformed;
+				else if( IsBannedPacket( manager, header, ntohl( p.address ), p.time ) )
+					verdicts[k] = Verdict::Banned;
+			}
+
+			return trace.packets.size( );
+		}
+
+		// FilterQueryChallenge, anything without a valid challenge gets a fresh one
+		size_t Challenge( const trace_t &trace )
+		{
+			size_t packets = 0;
+			for( size_t k = 0; k < trace.packets.size( ); ++k )
+			{
+				const int32_t offset = GetChallengeOffset( headers[k], options.policy );
+				if( verdicts[k] != Verdict::Engine || offset < 0 )
+					continue;
+
+				++packets;
+				const trace_packet_t &p = trace.packets[k];
+				const ChallengeStatus status =
+					CheckQueryChallenge( challenge_manager, trace.GetData( p ), p.length, offset, p.address, p.time );
+				if( status != ChallengeStatus::Valid )
+				{
+					bench::DoNotOptimize( challenge_manager.GetChallenge( p.address, p.time ) );
+					verdicts[k] = Verdict::Challenged;
+				}
+			}
+
+			return packets;
+		}
+
+		size_t RateLimit( const trace_t &trace )
+		{
+			size_t packets = 0;
+			for( size_t k = 0; k < trace.packets.size( ); ++k )
+			{
+				const PacketHeader header = headers[k];
+				if( verdicts[k] != Verdict::Engine || header == PacketHeader::Connected )
+					continue;
+
+				++packets;
+				const trace_packet_t &p = trace.packets[k];
+				if( !clients.CheckIPRate( ntohl( p.address ), GetQueryType( header ), p.time ) )
+					verdicts[k] = Verdict::RateLimited;
+				else if( IsAnsweredQuery( header, options.policy ) )
+					verdicts[k] = Verdict::Reply;
+			}
+
+			return packets;
+		}
+
+		// every reply built from scratch like an uncached hook result
+		size_t Serialize( )
+		{
+			GarrysMod::Lua::ILuaBase lua;
+			size_t packets = 0;
+			for( size_t k = 0; k < verdicts.size( ); ++k )
+			{
+				if( verdicts[k] != Verdict::Reply )
+					continue;
+
+				++packets;
+				packet.Reset( );
+				if( headers[k] == PacketHeader::Info )
+				{
+					if( options.lua )
+					{
+						lua.Push( GarrysMod::Lua::value_t::Table( &info_table ) );
+						WriteInfoReply( packet, &lua, -1, info );
+						lua.Pop( 1 );
+					}
+					else
+					{
+						WriteInfoReply( packet, info );
+					}
+				}
+				else if( headers[k] == PacketHeader::Player )
+				{
+					if( options.lua )
+					{
+						lua.Push( GarrysMod::Lua::value_t::Table( &players_table ) );
+						WritePlayerReply( packet, &lua, -1 );
+						lua.Pop( 1 );
+					}
+					else
+					{
+						const std::vector<std::string> &names = bench::GetPlayerNames( );
+						WritePlayerReplyHeader( packet );
+						for( int32_t p = 0; p < options.players; ++p )
+							WritePlayerReplyEntry(
+								packet,
+								static_cast<uint8_t>( p ),
+								names[static_cast<size_t>( p )].c_str( ),
+								p,
+								60.0 * p
+							);
+
+						WritePlayerReplyCount( packet, static_cast<uint8_t>( options.players ) );
+					}
+				}
+				else
+				{
+					WriteRulesReply( packet, rules );
+				}
+
+				bench::DoNotOptimize( buffer );
+			}
+
+			return packets;
+		}
+
+		const options_t &options;
+		ClientManager manager;
+		ClientShard clients;
+		reply_info_t info;
+		GarrysMod::Lua::table_t info_table;
+		GarrysMod::Lua::table_t players_table;
+		std::vector<GarrysMod::Lua::table_t> player_tables;
+		std::vector<std::pair<std::string, std::string>> rules;
+		char buffer[16384];
+		bf_write packet;
+		std::vector<PacketHeader> headers;
+		std::vector<Verdict> verdicts;
+	};
+
+	static bool ParseOptions( int argc, char **argv, options_t &options )
+	{
+		for( int k = 1; k < argc; ++k )
+		{
+			const std::string arg = argv[k];
+			const char *value = k + 1 < argc ? argv[k + 1] : nullptr;
+			if( arg == "--lua" )
+				options.lua = true;
+			else if( arg == "--no-limiter" )
+				options.limiter = false;
+			else if( arg == "--info-detour" )
+				options.policy.info_answered = true;
+			else if( arg == "--rules-detour" )
+				options.policy.rules_answered = true;
+			else if( arg == "--query-port" )
+				options.policy.info_answered = options.policy.rules_answered = true;
+			else if( arg == "--info-challenge" )
+				options.policy.info_challenge = true;
+			else if( arg == "--no-player-challenge" )
+				options.policy.player_challenge = false;
+			else if( value == nullptr )
+				return false;
+			else if( arg == "--trace" )
+				options.trace = argv[++k];
+			else if( arg == "--pcap" )
+			{
+				options.trace = "pcap";
+				options.pcap = argv[++k];
+			}
+			else if( arg == "--port" )
+				options.port = static_cast<uint16_t>( std::atoi( argv[++k] ) );
+			else if( arg == "--packets" )
+				options.packets = static_cast<size_t>( std::atoll( argv[++k] ) );
+			else if( arg == "--iterations" )
+				options.iterations = static_cast<size_t>( std::atoll( argv[++k] ) );
+			else if( arg == "--players" )
+				options.players = std::min( std::max( std::atoi( argv[++k] ), 0 ), 255 );
+			else
+				return false;
+		}
+
+		return options.packets != 0 && options.iterations != 0;
+	}
+}
+
+int main( int argc, char **argv )
+{
+	options_t options;
+	if( !ParseOptions( argc, argv, options ) )
+	{
+		std::fprintf(
+			stderr,
+			"usage: %s [--trace flood|browser|mixed] [--pcap file [--port port]] [--packets count]\n"
+			"          [--iterations count] [--players count] [--lua] [--no-limiter] [--info-detour]\n"
+			"          [--rules-detour] [--query-port] [--info-challenge] [--no-player-challenge]\n",
+			argv[0]
+		);
+		return 1;
+	}
+
+	trace_t trace;
+	if( options.trace == "flood" )
+		BuildFloodTrace( trace, options.packets );
+	else if( options.trace == "browser" )
+		BuildBrowserTrace( trace, options.packets );
+	else if( options.trace == "mixed" )
+		BuildMixedTrace( trace, options.packets, options.players );
+	else if( options.trace != "pcap" || !LoadPcapTrace( trace, options.pcap, options.port ) )
+	{
+		std::fprintf( stderr, "unable to build the %s trace\n", options.trace.c_str( ) );
+		return 1;
+	}
+
+	const size_t count = trace.packets.size( );
+	std::printf(
+		"trace %s: %zu packets, %d players, %s serializer, limiter %s, A2S_INFO by %s, A2S_RULES by %s\n",
+		options.trace.c_str( ),
+		count,
+		options.players,
+		options.lua ? "lua" : "native",
+		options.limiter ? "on" : "off",
+		options.policy.info_answered ? "module" : "engine",
+		options.policy.rules_answered ? "module" : "engine"
+	);
+
+	// a fresh pipeline every iteration so rate limits start from the same state, the
+	// iteration with the median total time is reported
+	std::vector<std::vector<stage_result_t>> runs;
+	std::vector<Verdict> verdicts;
+	for( size_t k = 0; k < options.iterations; ++k )
+	{
+		std::unique_ptr<pipeline_t> pipeline( new pipeline_t( options ) );
+		runs.emplace_back( );
+		pipeline->Run( trace, runs.back( ) );
+		verdicts.swap( pipeline->verdicts );
+	}
+
+	auto total = []( const std::vector<stage_result_t> &results )
+	{
+		uint64_t nanoseconds = 0;
+		for( const stage_result_t &result : results )
+			nanoseconds += result.nanoseconds;
+
+		return nanoseconds;
+	};
+	std::sort(
+		runs.begin( ),
+		runs.end( ),
+		[&]( const std::vector<stage_result_t> &a, const std::vector<stage_result_t> &b ) { return total( a ) < total( b ); }
+	);
+	const std::vector<stage_result_t> &median = runs[runs.size( ) / 2];
+
+	std::printf( "\n%-12s %12s %12s %14s\n", "stage", "packets", "ns/packet", "allocs/packet" );
+	for( const stage_result_t &result : median )
+	{
+		if( result.packets == 0 )
+		{
+			std::printf( "%-12s %12d %12s %14s\n", result.name, 0, "-", "-" );
+			continue;
+		}
+
+		const double packets = static_cast<double>( result.packets );
+		std::printf(
+			"%-12s %12zu %12.1f %14.3f\n",
+			result.name,
+			result.packets,
+			static_cast<double>( result.nanoseconds ) / packets,
+			static_cast<double>( result.allocations ) / packets
+		);
+	}
+
+	uint64_t allocations = 0;
+	for( const stage_result_t &result : median )
+		allocations += result.allocations;
+
+	const double nanoseconds = static_cast<double>( total( median ) );
+	std::printf(
+		"%-12s %12zu %12.1f %14.3f\n\n%.0f packets/sec\n\n",
+		"total",
+		count,
+		nanoseconds / static_cast<double>( count ),
+		static_cast<double>( allocations ) / static_cast<double>( count ),
+		static_cast<double>( count ) * 1e9 / nanoseconds
+	);
+
+	const char *names[] = { "engine", "malformed", "banned", "rate_limited", "challenged", "reply" };
+	size_t tally[6] = { };
+	for( const Verdict verdict : verdicts )
+		++tally[static_cast<size_t>( verdict )];
+
+	for( size_t k = 0; k < 6; ++k )
+		std::printf( "%-12s %12zu\n", names[k], tally[k] );
+
+	return 0;
+}
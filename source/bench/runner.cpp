@@ -0,0 +1,242 @@
+#include "runner.hpp"
+#include "bench.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <regex>
+#include <thread>
+
+namespace bench
+{
+	static uint64_t GetCPUTimeNanoseconds( )
+	{
+		return static_cast<uint64_t>( static_cast<double>( std::clock( ) ) * 1e9 / CLOCKS_PER_SEC );
+	}
+
+	static std::string EscapeJSON( const std::string &value )
+	{
+		std::string escaped;
+		for( const char c : value )
+		{
+			if( c == '"' || c == '\\' )
+				escaped.push_back( '\\' );
+
+			escaped.push_back( c );
+		}
+
+		return escaped;
+	}
+
+	State::State( uint64_t iterations ) :
+		iterations( iterations ),
+		remaining( iterations ),
+		running( false ),
+		start_real( 0 ),
+		start_cpu( 0 ),
+		start_allocations( 0 ),
+		real_time( 0 ),
+		cpu_time( 0 ),
+		allocations( 0 )
+	{ }
+
+	bool State::Toggle( )
+	{
+		if( !running && remaining != 0 )
+		{
+			running = true;
+			start_allocations = GetAllocations( );
+			start_cpu = GetCPUTimeNanoseconds( );
+			start_real = GetTimeNanoseconds( );
+			--remaining;
+			return true;
+		}
+
+		if( running )
+		{
+			real_time = GetTimeNanoseconds( ) - start_real;
+			cpu_time = GetCPUTimeNanoseconds( ) - start_cpu;
+			allocations = GetAllocations( ) - start_allocations;
+			running = false;
+		}
+
+		return false;
+	}
+
+	uint64_t State::GetIterations( ) const
+	{
+		return iterations;
+	}
+
+	void State::SetCounter( const char *name, double value )
+	{
+		counters.emplace_back( name, value );
+	}
+
+	void Runner::Register( const std::string &name, std::function<void( State & )> function )
+	{
+		benchmarks.push_back( { name, std::move( function ) } );
+	}
+
+	int Runner::Run( int argc, char **argv )
+	{
+		std::string filter = ".";
+		std::string format = "console";
+		std::string output;
+		double min_time = 0.5;
+		for( int k = 1; k < argc; ++k )
+		{
+			const std::string arg = argv[k];
+			const size_t equals = arg.find( '=' );
+			const std::string key = arg.substr( 0, equals );
+			const std::string value = equals != std::string::npos ? arg.substr( equals + 1 ) : "";
+			if( key == "--benchmark_filter" )
+				filter = value;
+			else if( key == "--benchmark_min_time" )
+				min_time = std::atof( value.c_str( ) );
+			else if( key == "--benchmark_format" )
+				format = value;
+			else if( key == "--benchmark_out" )
+				output = value;
+			else
+			{
+				std::fprintf( stderr, "unknown argument %s\n", arg.c_str( ) );
+				return 1;
+			}
+		}
+
+		const std::regex pattern( filter );
+		const bool console = format != "json";
+		if( console )
+			std::printf( "%-48s %14s %14s %12s %12s\n", "benchmark", "time (ns)", "cpu (ns)", "iterations", "allocs/iter" );
+
+		std::vector<result_t> results;
+		for( const benchmark_t &benchmark : benchmarks )
+		{
+			if( !std::regex_search( benchmark.name, pattern ) )
+				continue;
+
+			// grow the iteration count until a run takes long enough, like Google Benchmark
+			uint64_t iterations = 1;
+			while( true )
+			{
+				State state( iterations );
+				benchmark.function( state );
+
+				const double seconds = static_cast<double>( state.real_time ) / 1e9;
+				if( seconds >= min_time || iterations >= 1000000000 )
+				{
+					const double count = static_cast<double>( iterations );
+					result_t result = {
+						benchmark.name,
+						iterations,
+						static_cast<double>( state.real_time ) / count,
+						static_cast<double>( state.cpu_time ) / count,
+						static_cast<double>( state.allocations ) / count,
+						state.counters
+					};
+					if( console )
+						std::printf(
+							"%-48s %14.2f %14.2f %12llu %12.3f\n",
+							result.name.c_str( ),
+							result.real_time,
+							result.cpu_time,
+							static_cast<unsigned long long>( iterations ),
+							result.allocations
+						);
+
+					results.emplace_back( std::move( result ) );
+					break;
+				}
+
+				const double multiplier = seconds > 0.0 ? std::min( 10.0, min_time * 1.4 / seconds ) : 10.0;
+				iterations = static_cast<uint64_t>( std::max( static_cast<double>( iterations ) * multiplier, static_cast<double>( iterations + 1 ) ) );
+			}
+		}
+
+		const std::string json = ToJSON( results, argv[0] );
+		if( !console )
+			std::fputs( json.c_str( ), stdout );
+
+		if( !output.empty( ) )
+		{
+			FILE *file = std::fopen( output.c_str( ), "wb" );
+			if( file == nullptr )
+			{
+				std::fprintf( stderr, "unable to open %s\n", output.c_str( ) );
+				return 1;
+			}
+
+			std::fputs( json.c_str( ), file );
+			std::fclose( file );
+		}
+
+		return 0;
+	}
+
+	std::string Runner::ToJSON( const std::vector<result_t> &results, const char *executable )
+	{
+		char date[64] = { };
+		const std::time_t now = std::time( nullptr );
+		std::strftime( date, sizeof( date ), "%Y-%m-%dT%H:%M:%S%z", std::localtime( &now ) );
+
+		std::string json = "{\n  \"context\": {\n";
+		json += "    \"date\": \"" + std::string( date ) + "\",\n";
+		json += "    \"executable\": \"" + EscapeJSON( executable ) + "\",\n";
+		json += "    \"num_cpus\": " + std::to_string( std::thread::hardware_concurrency( ) ) + ",\n";
+
+#if defined NDEBUG
+
+		json += "    \"library_build_type\": \"release\"\n";
+
+#else
+
+		json += "    \"library_build_type\": \"debug\"\n";
+
+#endif
+
+		json += "  },\n  \"benchmarks\": [\n";
+		for( size_t k = 0; k < results.size( ); ++k )
+		{
+			const result_t &result = results[k];
+			char numbers[256] = { };
+			std::snprintf(
+				numbers,
+				sizeof( numbers ),
+				"      \"iterations\": %llu,\n"
+				"      \"real_time\": %.6e,\n"
+				"      \"cpu_time\": %.6e,\n"
+				"      \"time_unit\": \"ns\",\n"
+				"      \"allocs_per_iter\": %.6e",
+				static_cast<unsigned long long>( result.iterations ),
+				result.real_time,
+				result.cpu_time,
+				result.allocations
+			);
+
+			json += "    {\n";
+			json += "      \"name\": \"" + EscapeJSON( result.name ) + "\",\n";
+			json += "      \"family_index\": " + std::to_string( k ) + ",\n";
+			json += "      \"per_family_instance_index\": 0,\n";
+			json += "      \"run_name\": \"" + EscapeJSON( result.name ) + "\",\n";
+			json += "      \"run_type\": \"iteration\",\n";
+			json += "      \"repetitions\": 1,\n";
+			json += "      \"repetition_index\": 0,\n";
+			json += "      \"threads\": 1,\n";
+			json += numbers;
+			for( const auto &counter : result.counters )
+			{
+				char value[64] = { };
+				std::snprintf( value, sizeof( value ), "%.6e", counter.second );
+				json += ",\n      \"" + EscapeJSON( counter.first ) + "\": " + value;
+			}
+
+			json += k + 1 < results.size( ) ? "\n    },\n" : "\n    }\n";
+		}
+
+		json += "  ]\n}\n";
+		return json;
+	}
+}
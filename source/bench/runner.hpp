@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace bench
+{
+	// a tiny stand-in for Google Benchmark, same loop shape and the same JSON output so
+	// results can be diffed with its tools
+	class State
+	{
+	public:
+		State( uint64_t iterations );
+
+		// timing starts with the first call, setup done before the loop isn't measured
+		bool KeepRunning( )
+		{
+			if( remaining != 0 && running )
+			{
+				--remaining;
+				return true;
+			}
+
+			return Toggle( );
+		}
+
+		uint64_t GetIterations( ) const;
+
+		// reported per iteration next to the times
+		void SetCounter( const char *name, double value );
+
+	private:
+		friend class Runner;
+
+		bool Toggle( );
+
+		uint64_t iterations;
+		uint64_t remaining;
+		bool running;
+		uint64_t start_real;
+		uint64_t start_cpu;
+		uint64_t start_allocations;
+		uint64_t real_time;
+		uint64_t cpu_time;
+		uint64_t allocations;
+		std::vector<std::pair<std::string, double>> counters;
+	};
+
+	class Runner
+	{
+	public:
+		void Register( const std::string &name, std::function<void( State & )> function );
+
+		// understands --benchmark_filter=<regex>, --benchmark_min_time=<seconds>,
+		// --benchmark_format=console|json and --benchmark_out=<file> (always JSON)
+		int Run( int argc, char **argv );
+
+	private:
+		struct benchmark_t
+		{
+			std::string name;
+			std::function<void( State & )> function;
+		};
+
+		struct result_t
+		{
+			std::string name;
+			uint64_t iterations;
+			double real_time; // nanoseconds per iteration
+			double cpu_time;
+			double allocations;
+			std::vector<std::pair<std::string, double>> counters;
+		};
+
+		static std::string ToJSON( const std::vector<result_t> &results, const char *executable );
+
+		std::vector<benchmark_t> benchmarks;
+	};
+}
@@ -0,0 +1,69 @@
+#include "challenge.hpp"
+
+#include <random>
+
+namespace netfilter
+{
+	static inline uint64_t RotateLeft( uint64_t value, uint32_t bits )
+	{
+		return ( value << bits ) | ( value >> ( 64 - bits ) );
+	}
+
+	static inline void SipRound( uint64_t &v0, uint64_t &v1, uint64_t &v2, uint64_t &v3 )
+	{
+		v0 += v1; v1 = RotateLeft( v1, 13 ); v1 ^= v0; v0 = RotateLeft( v0, 32 );
+		v2 += v3; v3 = RotateLeft( v3, 16 ); v3 ^= v2;
+		v0 += v3; v3 = RotateLeft( v3, 21 ); v3 ^= v0;
+		v2 += v1; v1 = RotateLeft( v1, 17 ); v1 ^= v2; v2 = RotateLeft( v2, 32 );
+	}
+
+	// SipHash-2-4 specialized for a 16 byte message made of two 64 bit words
+	static uint64_t SipHash( const uint64_t key[2], uint64_t m0, uint64_t m1 )
+	{
+		uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+		uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+		uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+		uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+
+		const uint64_t words[] = { m0, m1, 16ULL << 56 };
+		for( const uint64_t m : words )
+		{
+			v3 ^= m;
+			SipRound( v0, v1, v2, v3 );
+			SipRound( v0, v1, v2, v3 );
+			v0 ^= m;
+		}
+
+		v2 ^= 0xFF;
+		for( uint32_t k = 0; k < 4; ++k )
+			SipRound( v0, v1, v2, v3 );
+
+		return v0 ^ v1 ^ v2 ^ v3;
+	}
+
+	ChallengeManager::ChallengeManager( )
+	{
+		std::random_device device;
+		for( uint64_t &k : key )
+			k = ( static_cast<uint64_t>( device( ) ) << 32 ) | device( );
+	}
+
+	uint32_t ChallengeManager::GetChallenge( uint32_t address, uint64_t time ) const
+	{
+		return Compute( address, time / RotationTime );
+	}
+
+	bool ChallengeManager::CheckChallenge( uint32_t address, uint32_t challenge, uint64_t time ) const
+	{
+		const uint64_t period = time / RotationTime;
+		return challenge == Compute( address, period ) ||
+			( period != 0 && challenge == Compute( address, period - 1 ) );
+	}
+
+	uint32_t ChallengeManager::Compute( uint32_t address, uint64_t period ) const
+	{
+		const uint32_t challenge = static_cast<uint32_t>( SipHash( key, address, period ) );
+		// -1 is what clients send when they're asking for a challenge
+		return challenge != 0xFFFFFFFF ? challenge : 0x7FFFFFFF;
+	}
+}
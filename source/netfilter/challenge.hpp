@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+
+namespace netfilter
+{
+	// Stateless A2S challenge numbers, a challenge is SipHash-2-4 of the source address
+	// and the current rotation period under a key picked at startup. Challenges from the
+	// previous period are still accepted so clients don't fail right after a rotation.
+	class ChallengeManager
+	{
+	public:
+		ChallengeManager( );
+
+		uint32_t GetChallenge( uint32_t address, uint64_t time ) const;
+		bool CheckChallenge( uint32_t address, uint32_t challenge, uint64_t time ) const;
+
+		static const uint64_t RotationTime = 30000000; // microseconds
+
+	private:
+		uint32_t Compute( uint32_t address, uint64_t period ) const;
+
+		uint64_t key[2];
+	};
+}
@@ -4,37 +4,73 @@
 
 namespace netfilter
 {
-	Client::Client( ClientManager &manager, uint32_t address ) :
-		manager( manager ), address( address ), last_reset( 0 ), count( 0 )
+	Client::Client( ClientManager &manager ) :
+		manager( manager ), address( 0 ), last_seen( 0 ), arrival( ), violation_window( 0 ),
+		violations( 0 ), valid( false ), referenced( false )
 	{ }
 
-	Client::Client( ClientManager &manager, uint32_t address, uint32_t time ) :
-		manager( manager ), address( address ), last_reset( time ), count( 1 )
-	{ }
+	void Client::Reset( uint32_t addr, uint64_t time )
+	{
+		address = addr;
+		last_seen = time;
+		for( uint64_t &tat : arrival )
+			tat = time;
+
+		violation_window = time;
+		violations = 0;
+
+		valid = true;
+		referenced = true;
+	}
+
+	void Client::Invalidate( )
+	{
+		valid = false;
+		referenced = false;
+	}
 
-	bool Client::CheckIPRate( uint32_t time )
+	bool Client::CheckIPRate( QueryType type, uint64_t time )
 	{
-		if( time - last_reset >= manager.GetMaxQueriesWindow( ) )
+		referenced = true;
+		last_seen = time;
+
+		const RateLimit &limit = manager.GetRateLimit( type );
+		if( !limit.Conforms( arrival[static_cast<size_t>( type )], time ) )
 		{
-			last_reset = time;
+			_DebugWarning(
+				"[ServerSecure] %d.%d.%d.% reached its query limit!\n",
+				( address >> 24 ) & 0xFF,
+				( address >> 16 ) & 0xFF,
+				( address >> 8 ) & 0xFF,
+				address & 0xFF
+			);
+			return false;
 		}
-		else
+
+		return true;
+	}
+
+	void Client::Refund( QueryType type )
+	{
+		manager.GetRateLimit( type ).Refund( arrival[static_cast<size_t>( type )] );
+	}
+
+	bool Client::CheckRate( const RateLimit &limit, uint64_t time )
+	{
+		referenced = true;
+		last_seen = time;
+		return limit.Conforms( arrival[0], time );
+	}
+
+	uint32_t Client::AddViolation( uint64_t time )
+	{
+		if( time - violation_window >= 1000000 )
 		{
-			++count;
-			if( count / manager.GetMaxQueriesWindow( ) >= manager.GetMaxQueriesPerSecond( ) )
-			{
-				_DebugWarning(
-					"[ServerSecure] %d.%d.%d.% reached its query limit!\n",
-					( address >> 24 ) & 0xFF,
-					( address >> 16 ) & 0xFF,
-					( address >> 8 ) & 0xFF,
-					address & 0xFF
-				);
-				return false;
-			}
+			violation_window = time;
+			violations = 0;
 		}
 
-		return true;
+		return ++violations;
 	}
 
 	uint32_t Client::GetAddress( ) const
@@ -42,8 +78,20 @@ namespace netfilter
 		return address;
 	}
 
-	bool Client::TimedOut( uint32_t time ) const
+	bool Client::IsValid( ) const
+	{
+		return valid;
+	}
+
+	bool Client::TimedOut( uint64_t time ) const
+	{
+		return time - last_seen >= ClientManager::ClientTimeout;
+	}
+
+	bool Client::TestAndClearReferenced( )
 	{
-		return last_reset - time >= ClientManager::ClientTimeout;
+		const bool was_referenced = referenced;
+		referenced = false;
+		return was_referenced;
 	}
 }
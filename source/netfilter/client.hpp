@@ -1,26 +1,53 @@
 #pragma once
 
 #include <cstdint>
+#include <cstddef>
 
 namespace netfilter
 {
 	class ClientManager;
+	class RateLimit;
+
+	enum class QueryType
+	{
+		Info,
+		Player,
+		Other
+	};
+
+	static const size_t QueryTypeCount = 3;
 
 	class Client
 	{
 	public:
-		Client( ClientManager &manager, uint32_t address );
-		Client( ClientManager &manager, uint32_t address, uint32_t time );
+		Client( ClientManager &manager );
+
+		void Reset( uint32_t address, uint64_t time );
+		// frees the slot, the next FindClient probing it can take it
+		void Invalidate( );
 
-		bool CheckIPRate( uint32_t time );
+		bool CheckIPRate( QueryType type, uint64_t time );
+		// undoes a successful CheckIPRate for a query that got rejected afterwards
+		void Refund( QueryType type );
+		// subnet entries share a single arrival time for every query type
+		bool CheckRate( const RateLimit &limit, uint64_t time );
+		// returns how many queries were rejected in the current second, this one included
+		uint32_t AddViolation( uint64_t time );
 
 		uint32_t GetAddress( ) const;
-		bool TimedOut( uint32_t time ) const;
+		bool IsValid( ) const;
+		bool TimedOut( uint64_t time ) const;
+		bool TestAndClearReferenced( );
 
 	private:
 		ClientManager &manager;
 		uint32_t address;
-		uint32_t last_reset;
-		uint32_t count;
+		uint64_t last_seen;
+		// GCRA theoretical arrival time (in microseconds) of each query type
+		uint64_t arrival[QueryTypeCount];
+		uint64_t violation_window;
+		uint32_t violations;
+		bool valid;
+		bool referenced;
 	};
 }
@@ -3,95 +3,438 @@
 
 namespace netfilter
 {
+	RateLimit::RateLimit( double rate, uint32_t burst ) :
+		rate( 0 ), burst( 0 ), interval( 0 ), tolerance( 0 )
+	{
+		Set( rate, burst );
+	}
+
+	void RateLimit::Set( double r, uint32_t b )
+	{
+		const double new_rate = r > 0.0 ? r : 0.0;
+		const uint32_t new_burst = b != 0 ? b : 1;
+		// computed from the double so rates below 1 don't truncate to "disabled"
+		uint64_t new_interval = new_rate > 0.0 ? static_cast<uint64_t>( 1000000.0 / new_rate + 0.5 ) : 0;
+		if( new_rate > 0.0 && new_interval == 0 )
+			new_interval = 1;
+
+		rate.store( new_rate, std::memory_order_relaxed );
+		burst.store( new_burst, std::memory_order_relaxed );
+		tolerance.store( new_interval * ( new_burst - 1 ), std::memory_order_relaxed );
+		interval.store( new_interval, std::memory_order_relaxed );
+	}
+
+	bool RateLimit::Conforms( uint64_t &arrival, uint64_t time ) const
+	{
+		const uint64_t step = interval.load( std::memory_order_relaxed );
+		if( step == 0 )
+			return true;
+
+		const uint64_t tat = arrival > time ? arrival : time;
+		if( tat - time > tolerance.load( std::memory_order_relaxed ) )
+			return false;
+
+		arrival = tat + step;
+		return true;
+	}
+
+	bool RateLimit::Conforms( std::atomic<uint64_t> &arrival, uint64_t time, uint32_t count ) const
+	{
+		const uint64_t step = interval.load( std::memory_order_relaxed );
+		if( step == 0 )
+			return true;
+
+		const uint64_t allowed = tolerance.load( std::memory_order_relaxed );
+		uint64_t tat = arrival.load( std::memory_order_relaxed );
+		for( ;; )
+		{
+			// the last of the cells has to conform too
+			const uint64_t start = tat > time ? tat : time;
+			if( start + step * ( count - 1 ) - time > allowed )
+				return false;
+
+			if( arrival.compare_exchange_weak( tat, start + step * count, std::memory_order_relaxed ) )
+				return true;
+		}
+	}
+
+	void RateLimit::Refund( uint64_t &arrival ) const
+	{
+		// an arrival time in the past conforms the same as one at the current time
+		arrival -= interval.load( std::memory_order_relaxed );
+	}
+
+	bool RateLimit::IsEnabled( ) const
+	{
+		return interval.load( std::memory_order_relaxed ) != 0;
+	}
+
+	double RateLimit::GetRate( ) const
+	{
+		return rate.load( std::memory_order_relaxed );
+	}
+
+	uint32_t RateLimit::GetBurst( ) const
+	{
+		return burst.load( std::memory_order_relaxed );
+	}
+
+	static inline uint32_t GetPrefix( uint32_t address, uint32_t bits )
+	{
+		return address & ~( 0xFFFFFFFF >> bits );
+	}
+
+	PrefixBans::PrefixBans( ) :
+		bans16( new std::atomic<uint32_t>[1 << 16]( ) ),
+		bans24( new std::atomic<uint64_t>[MaxSubnets]( ) )
+	{ }
+
+	bool PrefixBans::IsBanned( uint32_t address, uint64_t time ) const
+	{
+		const uint32_t now = static_cast<uint32_t>( time / 1000000 );
+		if( bans16[address >> 16].load( std::memory_order_relaxed ) > now )
+			return true;
+
+		const uint32_t prefix = address >> 8;
+		const uint32_t start = ( prefix * 2654435769u ) >> ( 32 - SubnetBits );
+		for( uint32_t k = 0; k < ProbeLength; ++k )
+		{
+			const uint64_t entry = bans24[( start + k ) & ( MaxSubnets - 1 )].load( std::memory_order_relaxed );
+			if( static_cast<uint32_t>( entry >> 32 ) == prefix && static_cast<uint32_t>( entry ) > now )
+				return true;
+		}
+
+		return false;
+	}
+
+	void PrefixBans::Ban16( uint32_t address, uint32_t until )
+	{
+		std::atomic<uint32_t> &ban = bans16[address >> 16];
+		uint32_t current = ban.load( std::memory_order_relaxed );
+		while( current < until && !ban.compare_exchange_weak( current, until, std::memory_order_relaxed ) )
+		{ }
+	}
+
+	void PrefixBans::Ban( uint32_t address, uint32_t bits, uint64_t time, uint64_t until )
+	{
+		const uint32_t now = static_cast<uint32_t>( time / 1000000 );
+		const uint32_t expiry = static_cast<uint32_t>( until / 1000000 ) + 1;
+		if( bits <= 16 )
+		{
+			Ban16( address, expiry );
+			return;
+		}
+
+		const uint32_t prefix = address >> 8;
+		const uint32_t start = ( prefix * 2654435769u ) >> ( 32 - SubnetBits );
+		const uint64_t entry = static_cast<uint64_t>( prefix ) << 32 | expiry;
+		for( uint32_t k = 0; k < ProbeLength; ++k )
+		{
+			std::atomic<uint64_t> &slot = bans24[( start + k ) & ( MaxSubnets - 1 )];
+			uint64_t current = slot.load( std::memory_order_relaxed );
+			// the same /24, an empty slot or an expired ban
+			if( ( static_cast<uint32_t>( current >> 32 ) == prefix || static_cast<uint32_t>( current ) <= now ) &&
+				slot.compare_exchange_strong( current, entry, std::memory_order_relaxed ) )
+				return;
+		}
+
+		// no room left for this /24, take the whole /16 down with it
+		Ban16( address, expiry );
+	}
+
+	void PrefixBans::Clear( )
+	{
+		for( uint32_t k = 0; k < 1 << 16; ++k )
+			bans16[k].store( 0, std::memory_order_relaxed );
+
+		for( uint32_t k = 0; k < MaxSubnets; ++k )
+			bans24[k].store( 0, std::memory_order_relaxed );
+	}
+
 	ClientManager::ClientManager( ) :
-		enabled( false ), global_count( 0 ), global_last_reset( 0 ), max_window( 60 ),
-		max_sec( 1 ), global_max_sec( 50 )
+		enabled( false ), limits{ { 2, 10 }, { 2, 10 }, { 10, 30 } }, limit24( 0, 1 ),
+		limit16( 0, 1 ), global_limit( 50, 50 ), ban_threshold( 0 ), ban_time( 0 ),
+		global_arrival( 0 )
 	{ }
 
 	void ClientManager::SetState( bool e )
 	{
-		enabled = e;
+		enabled.store( e, std::memory_order_relaxed );
 	}
 
-	bool ClientManager::CheckIPRate( uint32_t from, uint32_t time )
+	bool ClientManager::IsEnabled( ) const
 	{
-		if( !enabled )
-			return true;
+		return enabled.load( std::memory_order_relaxed );
+	}
 
-		if( clients.size( ) >= MaxClients )
-			for( auto it = clients.begin( ); it != clients.end( ); ++it )
-			{
-				const Client &client = ( *it ).second;
-				if( client.TimedOut( time ) && client.GetAddress( ) != from )
-				{
-					clients.erase( it );
-
-					if( clients.size( ) <= PruneAmount )
-						break;
-				}
-			}
+	const RateLimit &ClientManager::GetRateLimit( QueryType type ) const
+	{
+		return limits[static_cast<size_t>( type )];
+	}
+
+	const RateLimit &ClientManager::GetSubnetRateLimit( uint32_t bits ) const
+	{
+		return bits == 24 ? limit24 : limit16;
+	}
+
+	uint32_t ClientManager::GetBanThreshold( ) const
+	{
+		return ban_threshold.load( std::memory_order_relaxed );
+	}
 
-		auto it = clients.find( from );
-		if( it != clients.end( ) )
+	double ClientManager::GetGlobalMaxQueriesPerSecond( ) const
+	{
+		return global_limit.GetRate( );
+	}
+
+	void ClientManager::SetRateLimit( QueryType type, double rate, uint32_t burst )
+	{
+		limits[static_cast<size_t>( type )].Set( rate, burst );
+	}
+
+	void ClientManager::SetSubnetRateLimit( uint32_t bits, double rate, uint32_t burst )
+	{
+		( bits == 24 ? limit24 : limit16 ).Set( rate, burst );
+	}
+
+	void ClientManager::SetAutoBan( uint32_t threshold, uint64_t time )
+	{
+		ban_threshold.store( threshold, std::memory_order_relaxed );
+		ban_time.store( time, std::memory_order_relaxed );
+	}
+
+	bool ClientManager::IsBanned( uint32_t address, uint64_t time ) const
+	{
+		return bans.IsBanned( address, time );
+	}
+
+	void ClientManager::Ban( uint32_t address, uint32_t bits, uint64_t time )
+	{
+		_DebugWarning(
+			"[ServerSecure] %d.%d.%d.0/%d got banned!\n",
+			( address >> 24 ) & 0xFF,
+			( address >> 16 ) & 0xFF,
+			( address >> 8 ) & 0xFF,
+			bits
+		);
+		bans.Ban( address, bits, time, time + ban_time.load( std::memory_order_relaxed ) );
+	}
+
+	void ClientManager::ClearBans( )
+	{
+		bans.Clear( );
+	}
+
+	void ClientManager::SetGlobalMaxQueriesPerSecond( double max )
+	{
+		global_limit.Set( max, static_cast<uint32_t>( max ) );
+	}
+
+	bool ClientManager::AcquireGlobal( uint32_t count, uint64_t time )
+	{
+		return global_limit.Conforms( global_arrival, time, count );
+	}
+
+	uint32_t ClientManager::GetGlobalLeaseSize( ) const
+	{
+		const uint32_t size = static_cast<uint32_t>( global_limit.GetRate( ) ) / GlobalLeaseDivisor;
+		return size != 0 ? size : 1;
+	}
+
+	ClientShard::ClientShard( ClientManager &manager ) :
+		manager( manager ),
+		clients_used( 0 ),
+		subnets24_used( 0 ),
+		subnets16_used( 0 ),
+		leased( 0 ),
+		lease_expires( 0 ),
+		sweep_slice( 0 ),
+		last_sweep( 0 )
+	{
+		clients.reserve( MaxClients );
+		for( uint32_t k = 0; k < MaxClients; ++k )
+			clients.emplace_back( manager );
+
+		subnets24.reserve( MaxSubnets );
+		subnets16.reserve( MaxSubnets );
+		for( uint32_t k = 0; k < MaxSubnets; ++k )
 		{
-			Client &client = ( *it ).second;
-			if( !client.CheckIPRate( time ) )
-				return false;
+			subnets24.emplace_back( manager );
+			subnets16.emplace_back( manager );
 		}
-		else
-			clients.insert( std::make_pair( from, Client( *this, from, time ) ) );
+	}
 
-		if( time - global_last_reset > max_window )
+	bool ClientShard::CheckIPRate( uint32_t from, QueryType type, uint64_t time )
+	{
+		if( !manager.IsEnabled( ) )
+			return true;
+
+		bool created = false;
+		Client *client = FindClient( clients, clients_used, ClientBits, from, time, created );
+		if( !client->CheckIPRate( type, time ) )
+			return false;
+
+		// a query rejected further down doesn't use up the address' own budget
+		if( !CheckSubnetRate( subnets24, subnets24_used, 24, from, time ) ||
+			!CheckSubnetRate( subnets16, subnets16_used, 16, from, time ) )
 		{
-			global_last_reset = time;
-			global_count = 1;
+			client->Refund( type );
+			return false;
 		}
-		else
+
+		if( !CheckGlobalRate( time ) )
 		{
-			++global_count;
-			if( global_count / max_window >= global_max_sec )
-			{
-				_DebugWarning(
-					"[ServerSecure] %d.%d.%d.%d reached the global query limit!\n",
-					( from >> 24 ) & 0xFF,
-					( from >> 16 ) & 0xFF,
-					( from >> 8 ) & 0xFF,
-					from & 0xFF
-				);
-				return false;
-			}
+			client->Refund( type );
+			_DebugWarning(
+				"[ServerSecure] %d.%d.%d.%d reached the global query limit!\n",
+				( from >> 24 ) & 0xFF,
+				( from >> 16 ) & 0xFF,
+				( from >> 8 ) & 0xFF,
+				from & 0xFF
+			);
+			return false;
 		}
 
 		return true;
 	}
 
-	uint32_t ClientManager::GetMaxQueriesWindow( ) const
+	void ClientShard::Sweep( uint64_t time )
+	{
+		const uint64_t elapsed = time - last_sweep;
+		const uint64_t slices = elapsed >= SweepInterval ? SweepSlices : elapsed * SweepSlices / SweepInterval;
+		if( slices == 0 )
+			return;
+
+		last_sweep = time;
+		for( uint64_t k = 0; k < slices; ++k )
+		{
+			SweepSlice( clients, clients_used, sweep_slice, time );
+			SweepSlice( subnets24, subnets24_used, sweep_slice, time );
+			SweepSlice( subnets16, subnets16_used, sweep_slice, time );
+			sweep_slice = ( sweep_slice + 1 ) % SweepSlices;
+		}
+	}
+
+	void ClientShard::SweepSlice( std::vector<Client> &table, uint32_t &used, uint32_t slice, uint64_t time )
 	{
-		return max_window;
+		const size_t size = table.size( ) / SweepSlices;
+		for( size_t k = slice * size; k < ( slice + 1 ) * size; ++k )
+		{
+			Client &client = table[k];
+			if( client.IsValid( ) && client.TimedOut( time ) )
+			{
+				client.Invalidate( );
+				--used;
+			}
+		}
 	}
 
-	uint32_t ClientManager::GetMaxQueriesPerSecond( ) const
+	uint32_t ClientShard::GetClientCount( ) const
 	{
-		return max_sec;
+		return clients_used;
 	}
 
-	uint32_t ClientManager::GetGlobalMaxQueriesPerSecond( ) const
+	uint32_t ClientShard::GetSubnetCount( uint32_t bits ) const
 	{
-		return global_max_sec;
+		return bits == 24 ? subnets24_used : subnets16_used;
 	}
 
-	void ClientManager::SetMaxQueriesWindow( uint32_t window )
+	bool ClientShard::CheckSubnetRate(
+		std::vector<Client> &table,
+		uint32_t &used,
+		uint32_t bits,
+		uint32_t from,
+		uint64_t time
+	)
 	{
-		max_window = window;
+		const RateLimit &limit = manager.GetSubnetRateLimit( bits );
+		if( !limit.IsEnabled( ) )
+			return true;
+
+		const uint32_t prefix = GetPrefix( from, bits );
+		bool created = false;
+		Client *subnet = FindClient( table, used, SubnetBits, prefix, time, created );
+		if( subnet->CheckRate( limit, time ) )
+			return true;
+
+		const uint32_t threshold = manager.GetBanThreshold( );
+		if( threshold != 0 && subnet->AddViolation( time ) == threshold )
+			manager.Ban( prefix, bits, time );
+
+		return false;
 	}
 
-	void ClientManager::SetMaxQueriesPerSecond( uint32_t max )
+	bool ClientShard::CheckGlobalRate( uint64_t time )
 	{
-		max_sec = max;
+		if( leased != 0 && time < lease_expires )
+		{
+			--leased;
+			return true;
+		}
+
+		// unused tokens of an old lease are given up so they can't pile up as burst
+		const uint32_t size = manager.GetGlobalLeaseSize( );
+		if( manager.AcquireGlobal( size, time ) )
+		{
+			leased = size - 1;
+			lease_expires = time + LeaseTime;
+			return true;
+		}
+
+		// close to the limit a whole lease may not fit anymore
+		leased = 0;
+		return size > 1 && manager.AcquireGlobal( 1, time );
 	}
 
-	void ClientManager::SetGlobalMaxQueriesPerSecond( uint32_t max )
+	Client *ClientShard::FindClient(
+		std::vector<Client> &table,
+		uint32_t &used,
+		uint32_t bits,
+		uint32_t from,
+		uint64_t time,
+		bool &created
+	)
 	{
-		global_max_sec = max;
+		const uint32_t mask = ( 1u << bits ) - 1;
+		const uint32_t start = ( from * 2654435769u ) >> ( 32 - bits );
+
+		Client *empty = nullptr;
+		for( uint32_t k = 0; k < ProbeLength; ++k )
+		{
+			Client &client = table[( start + k ) & mask];
+			if( !client.IsValid( ) )
+			{
+				if( empty == nullptr )
+					empty = &client;
+
+				continue;
+			}
+
+			if( client.GetAddress( ) == from )
+			{
+				created = false;
+				return &client;
+			}
+		}
+
+		Client *victim = empty;
+		if( victim != nullptr )
+		{
+			++used;
+		}
+		else
+		{
+			// second chance over the probe window, timed out clients go first
+			for( uint32_t k = 0; k < ProbeLength * 2 && victim == nullptr; ++k )
+			{
+				Client &client = table[( start + k % ProbeLength ) & mask];
+				if( client.TimedOut( time ) || !client.TestAndClearReferenced( ) )
+					victim = &client;
+			}
+		}
+
+		victim->Reset( from, time );
+		created = true;
+		return victim;
 	}
 }
@@ -2,38 +2,173 @@
 
 #include "client.hpp"
 
-#include <map>
+#include <atomic>
+#include <memory>
+#include <vector>
 
 namespace netfilter
 {
+	// generic cell rate algorithm, equivalent to a token bucket of "burst" tokens
+	// refilled at "rate" tokens per second but only needs one timestamp of state,
+	// a rate of 0 disables the limit and fractional rates are fine (0.5 is one every 2s),
+	// Set is called from Lua while every receiving thread checks against it so the
+	// settings are atomics, a check racing with Set may mix old and new values once
+	class RateLimit
+	{
+	public:
+		RateLimit( double rate, uint32_t burst );
+
+		void Set( double rate, uint32_t burst );
+
+		bool Conforms( uint64_t &arrival, uint64_t time ) const;
+		// same as above for count cells at once on a shared arrival time
+		bool Conforms( std::atomic<uint64_t> &arrival, uint64_t time, uint32_t count ) const;
+		// gives back the cell of a query that a later check rejected
+		void Refund( uint64_t &arrival ) const;
+
+		bool IsEnabled( ) const;
+		double GetRate( ) const;
+		uint32_t GetBurst( ) const;
+
+	private:
+		std::atomic<double> rate;
+		std::atomic<uint32_t> burst;
+		// microseconds between cells, 0 when disabled
+		std::atomic<uint64_t> interval;
+		std::atomic<uint64_t> tolerance;
+	};
+
+	// temporary bans of whole prefixes shared by every thread, /16s are a flat array of
+	// expiry times and /24s live in a small lock-free hash table (prefix << 32 | expiry)
+	// that bans the whole /16 instead once it's full
+	class PrefixBans
+	{
+	public:
+		PrefixBans( );
+
+		bool IsBanned( uint32_t address, uint64_t time ) const;
+		void Ban( uint32_t address, uint32_t bits, uint64_t time, uint64_t until );
+		void Clear( );
+
+		static const uint32_t SubnetBits = 12;
+		static const uint32_t MaxSubnets = 1 << SubnetBits;
+		static const uint32_t ProbeLength = 8;
+
+	private:
+		void Ban16( uint32_t address, uint32_t until );
+
+		// expiry times in seconds
+		std::unique_ptr<std::atomic<uint32_t>[]> bans16;
+		std::unique_ptr<std::atomic<uint64_t>[]> bans24;
+	};
+
+	// rate limiting settings and the global limit shared by every ClientShard, settings
+	// are written from Lua and read by every receiving thread
 	class ClientManager
 	{
 	public:
 		ClientManager( );
 
 		void SetState( bool enabled );
+		bool IsEnabled( ) const;
+
+		const RateLimit &GetRateLimit( QueryType type ) const;
+		const RateLimit &GetSubnetRateLimit( uint32_t bits ) const;
+		double GetGlobalMaxQueriesPerSecond( ) const;
+		uint32_t GetBanThreshold( ) const;
+
+		void SetRateLimit( QueryType type, double rate, uint32_t burst );
+		// bits is either 24 or 16, a rate of 0 disables the limit
+		void SetSubnetRateLimit( uint32_t bits, double rate, uint32_t burst );
+		void SetGlobalMaxQueriesPerSecond( double max );
+		// a subnet rejecting threshold queries within a second is banned for time
+		// microseconds, a threshold of 0 disables automatic bans
+		void SetAutoBan( uint32_t threshold, uint64_t time );
+
+		bool IsBanned( uint32_t address, uint64_t time ) const;
+		void Ban( uint32_t address, uint32_t bits, uint64_t time );
+		void ClearBans( );
+
+		// takes count queries from the global limit at once, shards lease them in chunks
+		bool AcquireGlobal( uint32_t count, uint64_t time );
+		uint32_t GetGlobalLeaseSize( ) const;
 
-		bool CheckIPRate( uint32_t from, uint32_t time );
+		static const uint64_t ClientTimeout = 120000000; // microseconds
+		static const uint32_t GlobalLeaseDivisor = 64;
 
-		uint32_t GetMaxQueriesWindow( ) const;
-		uint32_t GetMaxQueriesPerSecond( ) const;
-		uint32_t GetGlobalMaxQueriesPerSecond( ) const;
+	private:
+		std::atomic_bool enabled;
+		RateLimit limits[QueryTypeCount];
+		RateLimit limit24;
+		RateLimit limit16;
+		RateLimit global_limit;
+		std::atomic<uint32_t> ban_threshold;
+		std::atomic<uint64_t> ban_time;
+		PrefixBans bans;
+		alignas( 64 ) std::atomic<uint64_t> global_arrival;
+	};
 
-		void SetMaxQueriesWindow( uint32_t window );
-		void SetMaxQueriesPerSecond( uint32_t max );
-		void SetGlobalMaxQueriesPerSecond( uint32_t max );
+	// per thread tables of clients and of their /24 and /16 subnets, only the owner
+	// thread touches them so checking a source never contends with other threads, the
+	// global limit is checked against tokens leased from the manager
+	// limits are per shard: query workers only get consistent per address and subnet
+	// limits because the kernel is told to pick their socket from the source /16 alone,
+	// and the game port has a shard of its own so a source using both ports gets a budget
+	// on each
+	class ClientShard
+	{
+	public:
+		ClientShard( ClientManager &manager );
 
-		static const uint32_t MaxClients = 4096;
-		static const uint32_t PruneAmount = MaxClients * 2 / 3;
-		static const uint32_t ClientTimeout = 120;
+		bool CheckIPRate( uint32_t from, QueryType type, uint64_t time );
+		// frees timed out entries a slice of the tables at a time, the whole tables are
+		// visited about once per SweepInterval however often it's called
+		void Sweep( uint64_t time );
+
+		// entries seen within ClientTimeout, up to a SweepInterval late
+		uint32_t GetClientCount( ) const;
+		uint32_t GetSubnetCount( uint32_t bits ) const;
+
+		static const uint32_t ClientBits = 12;
+		static const uint32_t MaxClients = 1 << ClientBits;
+		static const uint32_t SubnetBits = 10;
+		static const uint32_t MaxSubnets = 1 << SubnetBits;
+		static const uint32_t ProbeLength = 8;
+		static const uint64_t LeaseTime = 100000; // microseconds
+		static const uint64_t SweepInterval = 1000000; // microseconds
+		static const uint32_t SweepSlices = 64;
 
 	private:
-		std::map<uint32_t, Client> clients;
-		bool enabled;
-		uint32_t global_count;
-		uint32_t global_last_reset;
-		uint32_t max_window;
-		uint32_t max_sec;
-		uint32_t global_max_sec;
+		Client *FindClient(
+			std::vector<Client> &table,
+			uint32_t &used,
+			uint32_t bits,
+			uint32_t from,
+			uint64_t time,
+			bool &created
+		);
+		bool CheckSubnetRate(
+			std::vector<Client> &table,
+			uint32_t &used,
+			uint32_t bits,
+			uint32_t from,
+			uint64_t time
+		);
+		bool CheckGlobalRate( uint64_t time );
+		void SweepSlice( std::vector<Client> &table, uint32_t &used, uint32_t slice, uint64_t time );
+
+		ClientManager &manager;
+		// fixed size open addressing table, a new address only ever probes ProbeLength
+		// slots and evicts one of them (CLOCK) when none are free
+		std::vector<Client> clients;
+		std::vector<Client> subnets24;
+		std::vector<Client> subnets16;
+		uint32_t clients_used;
+		uint32_t subnets24_used;
+		uint32_t subnets16_used;
+		uint32_t leased;
+		uint64_t lease_expires;
+		uint32_t sweep_slice;
+		uint64_t last_sweep;
 	};
 }
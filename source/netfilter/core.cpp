@@ -1,5 +1,13 @@
 #include "core.hpp"
 #include "clientmanager.hpp"
+#include "spscqueue.hpp"
+#include "challenge.hpp"
+#include "packet.hpp"
+#include "serializer.hpp"
+#include "snapshot.hpp"
+#include "stats.hpp"
+#include "exporter.hpp"
+#include "sampler.hpp"
 #include "main.hpp"
 
 #include <GarrysMod/Lua/Interface.h>
@@ -13,6 +21,8 @@
 #include <eiface.h>
 #include <filesystem_stdio.h>
 #include <iserver.h>
+#include <iclient.h>
+#include <inetchannel.h>
 #include <threadtools.h>
 #include <utlvector.h>
 #include <bitbuf.h>
@@ -22,8 +32,14 @@
 #include <cstdint>
 #include <cstddef>
 #include <cstring>
+#include <cstdio>
 #include <queue>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <chrono>
 
 #if defined SYSTEM_WINDOWS
 
@@ -49,6 +65,11 @@ typedef int32_t recvlen_t;
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <linux/filter.h>
 
 #include <unordered_set>
 #include <atomic>
@@ -90,65 +111,132 @@ struct netsocket_t
 
 namespace netfilter
 {
+	static constexpr size_t threaded_socket_max_buffer = 8192;
+
+	// fixed size buffers allocated once with the slot, the receiver fills slots in place
+	// and recvfrom_detour hands them back by popping, compacting a batch swaps the buffers
+	// of two slots instead of copying packets around
 	struct packet_t
 	{
 		packet_t( ) :
 			address( ),
-			address_size( sizeof( address ) )
+			address_size( sizeof( address ) ),
+			length( 0 ),
+			buffer( new uint8_t[threaded_socket_max_buffer] )
 		{ }
 
 		sockaddr_in address;
 		socklen_t address_size;
-		std::vector<uint8_t> buffer;
+		size_t length;
+		std::unique_ptr<uint8_t[]> buffer;
+	};
+
+	enum class PacketType
+	{
+		Invalid = -1,
+		Good,
+		Info,
+		Player,
+		Rules
 	};
 
-	struct reply_info_t
-	{
-		bool dontsend;
-
-		std::string game_name;
-		std::string map_name;
-		std::string game_dir;
-		std::string gamemode_name;
-		int32_t amt_clients;
-		int32_t max_clients;
-		int32_t amt_bots;
-		char server_type;
-		char os_type;
-		bool passworded;
-		bool secure;
-		std::string game_version;
-		int32_t udp_port;
-		std::string tags;
-		int appid;
-		uint64_t steamid;
+	struct query_worker_t;
+
+	struct query_t
+	{
+		sockaddr_in address;
+		PacketType type;
+		query_worker_t *worker; // nullptr when it came in through the game socket
 	};
 
-	struct player_t
+	// a reply as it goes on the wire, replies bigger than the split size are stored as
+	// the Source multi-packet fragments so they're only split once
+	struct reply_packet_t
 	{
-		byte index;
-		std::string name;
-		double score;
-		double time;
+		std::vector<uint8_t> buffer; // every fragment back to back
+		std::vector<size_t> ends; // end offset of each fragment in buffer
+	};
+
+	typedef std::shared_ptr<const reply_packet_t> payload_t;
 
+	struct reply_t
+	{
+		sockaddr_in address;
+		payload_t buffer;
+		query_worker_t *worker;
 	};
 
-	struct reply_player_t
+	static constexpr size_t send_batch_max = 64;
+	static constexpr size_t send_batch_inline_max = 16;
+
+	// replies are accumulated by the receiver thread and flushed once per iteration
+	struct send_batch_t
 	{
-		bool dontsend;
-		bool senddefault;
+		size_t count;
+		sockaddr_in addresses[send_batch_max];
+		payload_t payloads[send_batch_max];
+		size_t fragments[send_batch_max];
+		uint8_t inline_buffers[send_batch_max][send_batch_inline_max];
+		size_t inline_lengths[send_batch_max];
+
+#if defined SYSTEM_LINUX
+
+		iovec iovecs[send_batch_max];
+		mmsghdr messages[send_batch_max];
+
+#endif
 
-		byte count;
-		std::vector<player_t> players;
 	};
 
+	// what a thread answering queries owns, the receiver thread has one for the game
+	// socket and every query worker has its own
+	struct responder_t
+	{
+		SOCKET socket;
+		size_t snapshot_reader;
+		ClientShard *clients;
+		query_worker_t *worker;
+		ThreadStats *stats;
+		sockaddr_in address; // local, only used to label sampled packets
+		uint32_t sample_countdown;
+		send_batch_t batch;
+	};
 
-	enum class PacketType
+	struct memo_entry_t
 	{
-		Invalid = -1,
-		Good,
-		Info,
-		Player,
+		payload_t packet; // nullptr when the hook asked us not to reply
+		double expires;
+		uint32_t generation;
+		uint32_t batch;
+	};
+
+	// hook results are memoized per source prefix, a prefix length of 0 means everyone
+	// shares the same reply and 32 means every address gets its own
+	struct reply_memo_t
+	{
+		std::unordered_map<uint32_t, memo_entry_t> entries;
+		double time;
+		uint32_t prefix;
+		uint32_t generation;
+		uint32_t batch;
+	};
+
+	// replies that are the same for every address, published by the main thread so the
+	// receiver thread can answer with them until they expire (microseconds)
+	struct reply_snapshot_t
+	{
+		reply_snapshot_t( ) :
+			info_expires( 0 ),
+			player_expires( 0 ),
+			rules_expires( 0 )
+		{ }
+
+		payload_t info;
+		uint64_t info_expires;
+		payload_t player;
+		uint64_t player_expires;
+		payload_t rules;
+		uint64_t rules_expires;
 	};
 
 #if defined SYSTEM_WINDOWS
@@ -169,6 +257,7 @@ namespace netfilter
 	static bool gameserver_context_initialized = false;
 
 	static SourceSDK::FactoryLoader icvar_loader( "vstdlib" );
+	static ICvar *icvar = nullptr;
 	static ConVar *sv_visiblemaxplayers = nullptr;
 
 	static SourceSDK::ModuleLoader dedicated_loader( "dedicated" );
@@ -196,37 +285,169 @@ namespace netfilter
 
 	static SOCKET game_socket = INVALID_SOCKET;
 
-	static constexpr size_t threaded_socket_max_buffer = 8192;
 	static constexpr size_t threaded_socket_max_queue = 1000;
+	static constexpr size_t threaded_socket_max_batch = 32;
 	static std::atomic_bool threaded_socket_execute( true );
 	static ThreadHandle_t threaded_socket_handle = nullptr;
-	static std::queue<packet_t> threaded_socket_queue;
-	static CThreadFastMutex threaded_socket_mutex;
+
+#if defined SYSTEM_LINUX
+
+	// the receiver thread sleeps in epoll until the socket is readable, the main thread
+	// queued replies, the engine freed queue slots (only signalled while the receiver
+	// waits for them) or the module is shutting down
+	static int32_t threaded_socket_epoll = -1;
+	static int32_t threaded_socket_full_epoll = -1;
+	static int32_t threaded_socket_shutdown_event = -1;
+	static int32_t threaded_socket_space_event = -1;
+	static int32_t threaded_socket_reply_event = -1;
+	static std::atomic_bool threaded_socket_waiting( false );
+
+#endif
+
+	// filled by the receiver thread, drained by the engine through recvfrom_detour
+	static SPSCQueue<packet_t, threaded_socket_max_queue> threaded_socket_queue;
+
+	// queries that need Lua are handed to the main thread and their replies come back
+	// to the receiver thread, which is the only one that touches the socket
+	static constexpr size_t query_max_queue = 1000;
+	static constexpr size_t query_batch_size = 64;
+	static std::queue<query_t> query_queue;
+	static CThreadFastMutex query_mutex;
+	static std::queue<reply_t> reply_queue;
+	static CThreadFastMutex reply_mutex;
+	static const char query_think_hook[] = "query.ProcessQueries";
+	static const char *info_dirty_events[] = { "player_connect", "player_disconnect" };
 
 	static constexpr char default_game_version[] = "2019.11.12";
-	static constexpr uint8_t default_proto_version = 17;
-	static bool info_cache_enabled = false;
+	static std::atomic_bool info_cache_enabled( false );
 	static reply_info_t reply_info;
 	static char info_cache_buffer[1024] = { 0 };
 	static bf_write info_cache_packet( info_cache_buffer, sizeof( info_cache_buffer ) );
+	static info_offsets_t info_cache_offsets = { 0, 0, 0, 0 };
+	static payload_t info_cache_payload;
+	static bool info_cache_dirty = false;
+	static char info_hook_buffer[1024] = { 0 };
+	static bf_write info_hook_packet( info_hook_buffer, sizeof( info_hook_buffer ) );
 	static uint32_t info_cache_last_update = 0;
 	static uint32_t info_cache_time = 5;
 
-	static reply_player_t reply_player;
-	static char player_cache_buffer[1024] = { 0 };
+	static constexpr size_t memo_max_entries = 4096;
+	static reply_memo_t info_memo = { { }, 0.0, 0, 0, 0 };
+
+	static std::atomic_bool rules_cache_enabled( false );
+	static std::vector<std::string> rules_convars;
+	static std::vector<std::pair<std::string, std::string>> reply_rules;
+	static char rules_cache_buffer[16384] = { 0 };
+	static bf_write rules_cache_packet( rules_cache_buffer, sizeof( rules_cache_buffer ) );
+	static uint32_t rules_cache_last_update = 0;
+	static reply_memo_t rules_memo = { { }, 0.0, 0, 0, 0 };
+
+	// A2S_PLAYER reply built from the engine's own client list, refreshed from the main
+	// thread so queries don't need to call into Lua
+	static bool player_snapshot_enabled = false;
+	static payload_t player_snapshot;
+	static double player_snapshot_last_update = 0.0;
+	static double player_snapshot_interval = 1.0;
+	static int32_t player_override_ref = -1;
+	static char player_cache_buffer[16384] = { 0 };
 	static bf_write player_cache_packet(player_cache_buffer, sizeof(player_cache_buffer));
 
+	// settings and the global limit are shared, every thread limits sources in its own shard
 	static ClientManager client_manager;
+	static ClientShard receiver_clients( client_manager );
+	static responder_t receiver = { INVALID_SOCKET, 0, &receiver_clients, nullptr, nullptr, { }, 0, { } };
+
+#if defined SYSTEM_LINUX
+
+	// optional pool of threads answering queries on a dedicated port, every worker has
+	// its own SO_REUSEPORT socket and a BPF program has the kernel pick the socket from
+	// the source /16 alone, so an address and its subnets always land on the same shard
+	static constexpr size_t query_worker_max = 32;
 
-	static constexpr size_t packet_sampling_max_queue = 50;
-	static std::queue<packet_t> packet_sampling_queue;
-	static CThreadFastMutex packet_sampling_mutex;
+	struct query_worker_t
+	{
+		query_worker_t( ) :
+			clients( client_manager ),
+			thread( nullptr ),
+			reply_event( -1 )
+		{ }
+
+		responder_t responder;
+		ClientShard clients;
+		ThreadHandle_t thread;
+		int32_t reply_event;
+		std::queue<reply_t> replies;
+		CThreadFastMutex reply_mutex;
+		packet_t packets[threaded_socket_max_batch];
+		iovec iovecs[threaded_socket_max_batch];
+		mmsghdr messages[threaded_socket_max_batch];
+	};
+
+	static std::vector<std::unique_ptr<query_worker_t>> query_workers;
+	static std::atomic_bool query_workers_execute( false );
+	static int32_t query_workers_shutdown_event = -1;
+
+#else
+
+	static constexpr size_t query_worker_max = 0;
+
+#endif
+
+	// the receiver thread is reader 0, query workers follow
+	static Snapshot<reply_snapshot_t, 1 + query_worker_max> reply_snapshot;
+	static bool reply_snapshot_dirty = false;
+
+	// every thread writes its own stats, the receiver thread is 0, the main thread 1 and
+	// query workers follow
+	static constexpr size_t stats_receiver = 0;
+	static constexpr size_t stats_main = 1;
+	static StatsRegistry stats_registry( 2 + query_worker_max );
+	static ThreadStats &main_stats = stats_registry.Get( stats_main );
+	static StatsExporter stats_exporter( stats_registry );
+
+	// replies bigger than this are sent as several packets with the split packet header
+	static constexpr size_t split_packet_header_size = 12;
+	static constexpr size_t split_packet_max_fragments = 255;
+	static size_t split_packet_size = 1248;
+	static uint32_t split_packet_id = 0;
+
+	static ChallengeManager challenge_manager;
+	// set from Lua, read by the receiver and the query workers
+	static std::atomic_bool info_challenge_enabled( false );
+	static std::atomic_bool player_challenge_enabled( true );
+
+	// sampled packets of every receiving thread, pcap dumps are written by their own thread
+	struct pcap_dump_t
+	{
+		std::string path;
+		std::vector<packet_sample_t> samples;
+	};
+
+	static PacketSampler packet_sampler;
+	static ThreadHandle_t pcap_dump_thread = nullptr;
+	static std::atomic_bool pcap_dump_running( false );
+	static const char *packet_type_names[] = { "invalid", "good", "info", "player", "rules" };
 
 	static IServerGameDLL *gamedll = nullptr;
+	static IPlayerInfoManager *playerinfo_manager = nullptr;
 	static IVEngineServer *engine_server = nullptr;
 	static IFileSystem *filesystem = nullptr;
 	static GarrysMod::Lua::ILuaInterface *lua = nullptr;
 
+	inline uint64_t GetTimeMicroseconds( )
+	{
+		return static_cast<uint64_t>( std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now( ).time_since_epoch( )
+		).count( ) );
+	}
+
+	inline uint64_t GetTimeNanoseconds( )
+	{
+		return static_cast<uint64_t>( std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now( ).time_since_epoch( )
+		).count( ) );
+	}
+
 	inline const char *IPToString( const in_addr &addr )
 	{
 		static char buffer[16] = { };
@@ -238,9 +459,44 @@ namespace netfilter
 		return str;
 	}
 
+	static payload_t MakePayload( const uint8_t *data, size_t len )
+	{
+		std::shared_ptr<reply_packet_t> payload = std::make_shared<reply_packet_t>( );
+		if( len <= split_packet_size )
+		{
+			payload->buffer.assign( data, data + len );
+			payload->ends.push_back( len );
+			return payload;
+		}
+
+		const size_t total = std::min( ( len + split_packet_size - 1 ) / split_packet_size, split_packet_max_fragments );
+		const uint32_t id = split_packet_id++ & 0x7FFFFFFF; // the high bit means compressed
+		payload->buffer.reserve( len + total * split_packet_header_size );
+		for( size_t k = 0; k < total; ++k )
+		{
+			uint8_t header[split_packet_header_size];
+			bf_write writer( header, sizeof( header ) );
+			writer.WriteLong( -2 ); // split packet header
+			writer.WriteLong( static_cast<int32_t>( id ) );
+			writer.WriteByte( static_cast<int32_t>( total ) );
+			writer.WriteByte( static_cast<int32_t>( k ) );
+			writer.WriteShort( static_cast<int32_t>( split_packet_size ) );
+
+			const size_t offset = k * split_packet_size;
+			const size_t size = std::min( len - offset, split_packet_size );
+			payload->buffer.insert( payload->buffer.end( ), header, header + sizeof( header ) );
+			payload->buffer.insert( payload->buffer.end( ), data + offset, data + offset + size );
+			payload->ends.push_back( payload->buffer.size( ) );
+		}
+
+		return payload;
+	}
+
 	static void BuildStaticReplyInfo( )
 	{
 		reply_info.gamemode_name = gamedll->GetGameDescription( );
+		reply_info.server_type = 'd'; // dedicated server identifier
+		reply_info.os_type = operating_system_char;
 
 		{
 			reply_info.game_dir.resize( 256 );
@@ -297,45 +553,19 @@ namespace netfilter
 		}
 	}
 
-	static void BuildReplyInfo( )
+	// returns whether any of the fields that change while a map is running changed
+	static bool UpdateReplyInfoCounts( )
 	{
-		const char *server_name = global::server->GetName( );
-
-		reply_info.game_name = server_name;
-
-		const char *map_name = global::server->GetMapName( );
-
-		reply_info.map_name = map_name;
-
-		const char *game_dir = reply_info.game_dir.c_str( );
-
-		reply_info.game_dir = game_dir;
-
-		const char *game_desc = reply_info.gamemode_name.c_str( );
-
-		const int32_t appid = engine_server->GetAppID( );
-
-		reply_info.appid = appid;
-
 		const int32_t num_clients = global::server->GetNumClients( );
 
-		reply_info.amt_clients = num_clients;
-
+		const int32_t max_clients = global::server->GetMaxClients( );
 		int32_t max_players =
 			sv_visiblemaxplayers != nullptr ? sv_visiblemaxplayers->GetInt( ) : -1;
-		if( max_players <= 0 || max_players > reply_info.max_clients )
-			max_players = reply_info.max_clients;
-
-		reply_info.max_clients = max_players;
+		if( max_players <= 0 || max_players > max_clients )
+			max_players = max_clients;
 
 		const int32_t num_fake_clients = global::server->GetNumFakeClients( );
 
-		reply_info.amt_bots = num_fake_clients;
-
-		const bool has_password = global::server->GetPassword( ) != nullptr;
-
-		reply_info.amt_bots = has_password;
-
 		if( !gameserver_context_initialized )
 			gameserver_context_initialized = gameserver_context.Init( );
 
@@ -347,63 +577,81 @@ namespace netfilter
 				vac_secure = steamGS->BSecure( );
 		}
 
+		const bool changed =
+			reply_info.amt_clients != num_clients ||
+			reply_info.max_clients != max_players ||
+			reply_info.amt_bots != num_fake_clients ||
+			reply_info.secure != vac_secure;
+
+		reply_info.amt_clients = num_clients;
+		reply_info.max_clients = max_players;
+		reply_info.amt_bots = num_fake_clients;
 		reply_info.secure = vac_secure;
+		return changed;
+	}
 
-		const char *game_version = reply_info.game_version.c_str( );
+	static void UpdateInfoCachePayload( )
+	{
+		info_cache_payload = MakePayload(
+			info_cache_packet.GetData( ),
+			static_cast<size_t>( info_cache_packet.GetNumBytesWritten( ) )
+		);
+	}
 
-		const int32_t udp_port = reply_info.udp_port;
+	static void BuildReplyInfo( )
+	{
+		reply_info.game_name = global::server->GetName( );
+		reply_info.map_name = global::server->GetMapName( );
+		reply_info.appid = engine_server->GetAppID( );
+		reply_info.passworded = global::server->GetPassword( ) != nullptr;
 
 		const CSteamID *sid = engine_server->GetGameServerSteamID( );
-		const uint64_t steamid = sid != nullptr ? sid->ConvertToUint64( ) : 0;
-		reply_info.steamid = steamid;
-		const bool has_tags = !reply_info.tags.empty( );
-		const char *tags = has_tags ? reply_info.tags.c_str( ) : nullptr;
-
-		info_cache_packet.Reset( );
-
-		info_cache_packet.WriteLong( -1 ); // connectionless packet header
-		info_cache_packet.WriteByte( 'I' ); // packet type is always 'I'
-		info_cache_packet.WriteByte( default_proto_version );
-		info_cache_packet.WriteString( server_name );
-		info_cache_packet.WriteString( map_name );
-		info_cache_packet.WriteString( game_dir );
-		info_cache_packet.WriteString( game_desc );
-		info_cache_packet.WriteShort( appid );
-		info_cache_packet.WriteByte( num_clients );
-		info_cache_packet.WriteByte( max_players );
-		info_cache_packet.WriteByte( num_fake_clients );
-		info_cache_packet.WriteByte( 'd' ); // dedicated server identifier
-		info_cache_packet.WriteByte( operating_system_char );
-		info_cache_packet.WriteByte( has_password ? 1 : 0 );
-		info_cache_packet.WriteByte( vac_secure );
-		info_cache_packet.WriteString( game_version );
-		// 0x80 - port number is present
-		// 0x10 - server steamid is present
-		// 0x20 - tags are present
-		// 0x01 - game long appid is present
-		info_cache_packet.WriteByte( 0x80 | 0x10 | ( has_tags ? 0x20 : 0x00 ) | 0x01 );
-		info_cache_packet.WriteShort( udp_port );
-		info_cache_packet.WriteLongLong( steamid );
-		if( has_tags )
-			info_cache_packet.WriteString( tags );
-		info_cache_packet.WriteLongLong( appid );
-	}
-
-		reply_info_t CallInfoHook(const sockaddr_in &from)
+		reply_info.steamid = sid != nullptr ? sid->ConvertToUint64( ) : 0;
+
+		UpdateReplyInfoCounts( );
+
+		WriteInfoReply( info_cache_packet, reply_info, &info_cache_offsets );
+		UpdateInfoCachePayload( );
+	}
+
+	// player counts and the VAC flag are patched in place, the strings only change with a
+	// full rebuild
+	static void PatchReplyInfo( )
+	{
+		if( !UpdateReplyInfoCounts( ) )
+			return;
+
+		PatchInfoReply( info_cache_packet, info_cache_offsets, reply_info );
+		UpdateInfoCachePayload( );
+
+		// memoized hook replies were built from the old counts
+		++info_memo.generation;
+		reply_snapshot_dirty = true;
+	}
+
+	enum class HookResult
+	{
+		Reply,
+		DontSend,
+		SendDefault
+	};
+
+	// writes the reply into info_hook_packet when the hook returned a table
+	static HookResult CallInfoHook( const sockaddr_in &from )
 	{
 		char hook[] = "A2S_INFO";
 
-		/*if (!ThreadInMainThread()) {
+		if (!ThreadInMainThread()) {
 			Warning("[%s] Called outside of main thread!\n", hook);
-			return reply_info;
-		}*/
+			return HookResult::DontSend;
+		}
 
 		lua->GetField(GarrysMod::Lua::INDEX_GLOBAL, "hook");
 		if (!lua->IsType(-1, GarrysMod::Lua::Type::TABLE))
 		{
 			lua->Pop(1);
 			Warning("[%s] Missing hook table!\n", hook);
-			return reply_info;
+			return HookResult::SendDefault;
 		}
 
 		lua->GetField(-1, "Run");
@@ -411,7 +659,7 @@ namespace netfilter
 		{
 			lua->Pop(2);
 			Warning("[%s] hook.Run is not a function!\n", hook);
-			return reply_info;
+			return HookResult::SendDefault;
 		} else {
 			lua->Remove(-2);
 			lua->PushString(hook);
@@ -423,13 +671,13 @@ namespace netfilter
 		lua->CreateTable();
 
 		lua->PushString(reply_info.game_name.c_str());
-		lua->SetField(-2, "name");//
+		lua->SetField(-2, "name");
 
 		lua->PushString(reply_info.map_name.c_str());
 		lua->SetField(-2, "map");
 
 		lua->PushString(reply_info.game_dir.c_str());
-		lua->SetField(-2, "folder");//
+		lua->SetField(-2, "folder");
 
 		lua->PushString(reply_info.gamemode_name.c_str());
 		lua->SetField(-2, "gamemode");
@@ -443,10 +691,10 @@ namespace netfilter
 		lua->PushNumber(reply_info.amt_bots);
 		lua->SetField(-2, "bots");
 
-		lua->PushString(&reply_info.server_type);
+		lua->PushString(&reply_info.server_type, 1);
 		lua->SetField(-2, "servertype");
 
-		lua->PushString(&reply_info.os_type);
+		lua->PushString(&reply_info.os_type, 1);
 		lua->SetField(-2, "os");
 
 		lua->PushBool(reply_info.passworded);
@@ -458,8 +706,9 @@ namespace netfilter
 		lua->PushNumber(reply_info.udp_port);
 		lua->SetField(-2, "gameport");
 
-		std::string steamid = std::to_string(reply_info.steamid);
-		lua->PushString(steamid.c_str());
+		char steamid[24] = { 0 };
+		snprintf(steamid, sizeof(steamid), "%llu", static_cast<unsigned long long>(reply_info.steamid));
+		lua->PushString(steamid);
 		lua->SetField(-2, "steamid");
 
 		lua->PushString(reply_info.tags.c_str());
@@ -467,121 +716,38 @@ namespace netfilter
 
 		lua->CallFunctionProtected(4, 1, true);
 
-		reply_info_t newreply;
-		newreply.dontsend = false;
-
-		newreply.game_name = reply_info.game_name;
-		newreply.map_name = reply_info.map_name;
-		newreply.game_dir = reply_info.game_dir;
-		newreply.gamemode_name = reply_info.gamemode_name;
-		newreply.amt_clients = reply_info.amt_clients;
-		newreply.max_clients = reply_info.max_clients;
-		newreply.amt_bots = reply_info.amt_bots;
-		newreply.server_type = reply_info.server_type;
-		newreply.os_type = reply_info.os_type;
-		newreply.passworded = reply_info.passworded;
-		newreply.secure = reply_info.secure;
-		newreply.game_version = reply_info.game_version;
-		newreply.udp_port = reply_info.udp_port;
-		newreply.tags = reply_info.tags;
-		newreply.appid = reply_info.appid;
-		newreply.steamid = reply_info.steamid;
-
-		if (lua->IsType(-1, GarrysMod::Lua::Type::BOOL))
+		HookResult result = HookResult::SendDefault; // return default unless told otherwise
+		if (lua->IsType(-1, GarrysMod::Lua::Type::TABLE))
 		{
-			if (lua->GetBool(-1))
-			{
-				newreply = reply_info; // return default when return true
-			}
-			else
-			{
-				newreply.dontsend = true; // dont send when return false
-			}
+			WriteInfoReply(info_hook_packet, lua, -1, reply_info);
+			result = HookResult::Reply;
 		}
-		else if (lua->IsType(-1, GarrysMod::Lua::Type::TABLE))
+		else if (lua->IsType(-1, GarrysMod::Lua::Type::BOOL) && !lua->GetBool(-1))
 		{
-			lua->GetField(-1, "name");
-			newreply.game_name = lua->GetString(-1);
-			lua->Pop(1);
-
-			lua->GetField(-1, "map");
-			newreply.map_name = lua->GetString(-1);
-			lua->Pop(1);
-
-			lua->GetField(-1, "folder");
-			newreply.game_dir = lua->GetString(-1);
-			lua->Pop(1);
-
-			lua->GetField(-1, "gamemode");
-			newreply.gamemode_name = lua->GetString(-1);
-			lua->Pop(1);
-
-			lua->GetField(-1, "players");
-			newreply.amt_clients = lua->GetNumber(-1);
-			lua->Pop(1);
-
-			lua->GetField(-1, "maxplayers");
-			newreply.max_clients = lua->GetNumber(-1);
-			lua->Pop(1);
-
-			lua->GetField(-1, "bots");
-			newreply.amt_bots = lua->GetNumber(-1);
-			lua->Pop(1);
-
-			lua->GetField(-1, "servertype");
-			newreply.server_type = lua->GetString(-1)[0]; //make into char
-			lua->Pop(1);
-
-			lua->GetField(-1, "os");
-			newreply.os_type = lua->GetString(-1)[0];
-			lua->Pop(1);
-
-			lua->GetField(-1, "passworded");
-			newreply.passworded = lua->GetBool(-1);
-			lua->Pop(1);
-
-			lua->GetField(-1, "VAC");
-			newreply.secure = lua->GetBool(-1);
-			lua->Pop(1);
-
-			lua->GetField(-1, "gameport");
-			newreply.udp_port = lua->GetNumber(-1);
-			lua->Pop(1);
-
-			lua->GetField(-1, "steamid");
-			newreply.steamid = strtoll(lua->GetString(-1), 0, 10);
-			lua->Pop(1);
-
-			lua->GetField(-1, "tags");
-			newreply.tags = lua->GetString(-1);
-			lua->Pop(1);
+			result = HookResult::DontSend; // dont send when return false
 		}
 
 		lua->Pop(1);
 
-		return newreply;
+		return result;
 	}
 
-	static reply_player_t CallPlayerHook(const sockaddr_in &from)
+	// writes the reply into player_cache_packet when the hook returned a player list
+	static HookResult CallPlayerHook( const sockaddr_in &from )
 	{
-		reply_player_t newreply;
-		newreply.dontsend = false;
-		newreply.senddefault = true;
-
-
 		char hook[] = "A2S_PLAYER";
 
-		/*if (!ThreadInMainThread()) {
+		if (!ThreadInMainThread()) {
 			Warning("[%s] Called outside of main thread!\n", hook);
-			return newreply;
-		}*/
+			return HookResult::DontSend;
+		}
 
 		lua->GetField(GarrysMod::Lua::INDEX_GLOBAL, "hook");
 		if (!lua->IsType(-1, GarrysMod::Lua::Type::TABLE))
 		{
 			lua->Pop(1);
 			Warning("[%s] Missing hook table!\n", hook);
-			return newreply;
+			return HookResult::SendDefault;
 		}
 
 		lua->GetField(-1, "Run");
@@ -589,7 +755,7 @@ namespace netfilter
 		{
 			lua->Pop(2);
 			Warning("[%s] hook.Run is not a function!\n", hook);
-			return newreply;
+			return HookResult::SendDefault;
 		} else {
 			lua->Remove(-2);
 			lua->PushString(hook);
@@ -600,377 +766,2106 @@ namespace netfilter
 
 		lua->CallFunctionProtected(3, 1, true);
 
+		HookResult result = HookResult::SendDefault;
 		if (lua->IsType(-1, GarrysMod::Lua::Type::BOOL))
 		{
 			if (!lua->GetBool(-1))
-			{
-				newreply.senddefault = false;
-				newreply.dontsend = true; // dont send when return false
-			}
+				result = HookResult::DontSend; // dont send when return false
 		}
 		else if (lua->IsType(-1, GarrysMod::Lua::Type::TABLE))
 		{
-			newreply.senddefault = false;
-
-			int count = lua->ObjLen(-1);
-			newreply.count = count;
-
-			std::vector<player_t> newPlayers(count);
-
-			for (int i = 0; i < count; i++)
-			{
-				player_t newPlayer;
-				newPlayer.index = i;
-
-				lua->PushNumber(i + 1);
-				lua->GetTable(-2);
-
-				lua->GetField(-1, "name");
-				newPlayer.name = lua->GetString(-1);
-				lua->Pop(1);
-
-				lua->GetField(-1, "score");
-				newPlayer.score = lua->GetNumber(-1);
-				lua->Pop(1);
-
-				lua->GetField(-1, "time");
-				newPlayer.time = lua->GetNumber(-1);
-				lua->Pop(1);
-
-				lua->Pop(1);
-				newPlayers.at(i) = newPlayer;
-			}
-
-			newreply.players = newPlayers;
+			WritePlayerReply(player_cache_packet, lua, -1);
+			result = HookResult::Reply;
 		}
 
 		lua->Pop(1);
 
-		return newreply;
+		return result;
 	}
 
-	static void BuildReplyInfoPacket(reply_info_t info)
+	static void BuildReplyRules( )
 	{
-		info_cache_packet.Reset();
+		reply_rules.clear( );
+		if( icvar == nullptr )
+			return;
 
-		info_cache_packet.WriteLong(-1); // connectionless packet header
-		info_cache_packet.WriteByte('I'); // packet type is always 'I'
-		info_cache_packet.WriteByte(default_proto_version);
-
-		info_cache_packet.WriteString(info.game_name.c_str());
-
-		info_cache_packet.WriteString(info.map_name.c_str());
-		info_cache_packet.WriteString(info.game_dir.c_str());
-		info_cache_packet.WriteString(info.gamemode_name.c_str());
-
-		info_cache_packet.WriteShort(info.appid);
-
-		info_cache_packet.WriteByte(info.amt_clients);
-		info_cache_packet.WriteByte(info.max_clients);
-		info_cache_packet.WriteByte(info.amt_bots);
-		info_cache_packet.WriteByte(info.server_type);
-		info_cache_packet.WriteByte(info.os_type);
-		info_cache_packet.WriteByte(info.passworded);
-
-		// if vac protected, it activates itself some time after startup
-		info_cache_packet.WriteByte(info.secure);
-		info_cache_packet.WriteString(info.game_version.c_str());
-
-		bool notags = info.tags.empty();
-		// 0x80 - port number is present
-		// 0x10 - server steamid is present
-		// 0x20 - tags are present
-		// 0x01 - game long appid is present
-		info_cache_packet.WriteByte(0x80 | 0x10 | (notags ? 0x00 : 0x20) | 0x01);
-		info_cache_packet.WriteShort(info.udp_port);
-		info_cache_packet.WriteLongLong(info.steamid);
-		if (!notags)
-			info_cache_packet.WriteString(info.tags.c_str());
-		info_cache_packet.WriteLongLong(info.appid);
+		for( const std::string &name : rules_convars )
+		{
+			const ConVar *convar = icvar->FindVar( name.c_str( ) );
+			if( convar != nullptr )
+				reply_rules.emplace_back( name, convar->GetString( ) );
+		}
 	}
 
-	static void BuildReplyPlayerPacket(reply_player_t r_player)
+	// returns false when the hook asked us not to reply
+	static bool CallRulesHook( const sockaddr_in &from, std::vector<std::pair<std::string, std::string>> &rules )
 	{
-		player_cache_packet.Reset();
+		static const char hook[] = "A2S_RULES";
 
-		player_cache_packet.WriteLong(-1); // connectionless packet header
-		player_cache_packet.WriteByte('D'); // packet type is always 'D'
+		rules = reply_rules;
 
-		player_cache_packet.WriteByte(r_player.count);
-		for (int i = 0; i < r_player.count; i++)
+		if( !ThreadInMainThread( ) )
 		{
-			player_t player = r_player.players[i];
-			player_cache_packet.WriteByte(i);
-			player_cache_packet.WriteString(player.name.c_str());
-			player_cache_packet.WriteLong(player.score);
-			player_cache_packet.WriteFloat(player.time);
+			Warning( "[%s] Called outside of main thread!\n", hook );
+			return false;
 		}
 
-	}
-
-	inline PacketType SendInfoCache( const sockaddr_in &from, uint32_t time )
-	{
-		if( time - info_cache_last_update >= info_cache_time )
+		lua->GetField( GarrysMod::Lua::INDEX_GLOBAL, "hook" );
+		if( !lua->IsType( -1, GarrysMod::Lua::Type::Table ) )
 		{
-			BuildReplyInfo( );
-			info_cache_last_update = time;
+			lua->Pop( 1 );
+			Warning( "[%s] Missing hook table!\n", hook );
+			return true;
 		}
 
-		reply_info_t info = CallInfoHook(from);
-		if(info.dontsend)
-			return PacketType::Invalid;
-
-		BuildReplyInfoPacket(info);
+		lua->GetField( -1, "Run" );
+		if( !lua->IsType( -1, GarrysMod::Lua::Type::Function ) )
+		{
+			lua->Pop( 2 );
+			Warning( "[%s] hook.Run is not a function!\n", hook );
+			return true;
+		}
 
-		sendto(
-			game_socket,
-			reinterpret_cast<char *>( info_cache_packet.GetData( ) ),
-			info_cache_packet.GetNumBytesWritten( ),
-			0,
-			reinterpret_cast<const sockaddr *>( &from ),
-			sizeof( from )
-		);
+		lua->Remove( -2 );
+		lua->PushString( hook );
+		lua->PushString( inet_ntoa( from.sin_addr ) );
+		lua->PushNumber( ntohs( from.sin_port ) );
 
-		_DebugWarning( "[Query] Handled %s info request using cache\n", IPToString( from.sin_addr ) );
+		lua->CreateTable( );
+		for( const auto &rule : reply_rules )
+		{
+			lua->PushString( rule.second.c_str( ) );
+			lua->SetField( -2, rule.first.c_str( ) );
+		}
 
-		return PacketType::Invalid; // we've handled it
-	}
+		lua->CallFunctionProtected( 4, 1, true );
 
-	inline PacketType HandleInfoQuery( const sockaddr_in &from )
-	{
-		const uint32_t time = static_cast<uint32_t>( Plat_FloatTime( ) );
-		if( !client_manager.CheckIPRate( from.sin_addr.s_addr, time ) )
+		bool send = true;
+		if( lua->IsType( -1, GarrysMod::Lua::Type::Bool ) )
 		{
-			_DebugWarning( "[Query] Client %s hit rate limit\n", IPToString( from.sin_addr ) );
-			return PacketType::Invalid;
+			send = lua->GetBool( -1 ); // true sends the default rules
 		}
+		else if( lua->IsType( -1, GarrysMod::Lua::Type::Table ) )
+		{
+			rules.clear( );
 
-		if( info_cache_enabled )
-			return SendInfoCache( from, time );
+			lua->PushNil( );
+			while( lua->Next( -2 ) != 0 )
+			{
+				// copy the key so GetString doesn't convert it in place and break Next
+				lua->Push( -2 );
+				const char *name = lua->GetString( -1 );
+				const char *value = lua->GetString( -2 );
+				if( name != nullptr && value != nullptr )
+					rules.emplace_back( name, value );
+
+				lua->Pop( 2 );
+			}
+		}
 
-		return PacketType::Good;
+		lua->Pop( 1 );
+		return send;
 	}
 
-	static PacketType HandlePlayerQuery(const sockaddr_in &from)
+	static void BuildReplyRulesPacket( const std::vector<std::pair<std::string, std::string>> &rules )
 	{
-		_DebugWarning("[Query] Handling A2S_PLAYER from %s\n",IPToString( from.sin_addr ));
-		reply_player_t player = CallPlayerHook(from);
+		rules_cache_packet.Reset( );
+		WriteRulesReply( rules_cache_packet, rules );
+	}
 
-		if (player.senddefault)
-			return PacketType::Good;
+	inline bool PushQueryToQueue( query_t &&q, size_t &depth )
+	{
+		AUTO_LOCK( query_mutex );
+		depth = query_queue.size( );
+		if( depth >= query_max_queue )
+			return false;
 
-		if (player.dontsend)
-			return PacketType::Invalid; // dont send it
+		query_queue.emplace( std::move( q ) );
+		++depth;
+		return true;
+	}
 
-		BuildReplyPlayerPacket(player);
+	inline size_t PopQueriesFromQueue( std::vector<query_t> &queries, size_t max )
+	{
+		AUTO_LOCK( query_mutex );
 
-		sendto(
-			game_socket,
-			reinterpret_cast<char *>(player_cache_packet.GetData()),
-			player_cache_packet.GetNumBytesWritten(),
-			0,
-			reinterpret_cast<const sockaddr *>(&from),
-			sizeof(from)
-		);
+		const size_t count = std::min( query_queue.size( ), max );
+		for( size_t k = 0; k < count; ++k )
+		{
+			queries.emplace_back( std::move( query_queue.front( ) ) );
+			query_queue.pop( );
+		}
 
-		return PacketType::Invalid; // we've handled it
+		return count;
 	}
 
-	static PacketType ClassifyPacket( const uint8_t *data, int32_t len, const sockaddr_in &from )
+#if defined SYSTEM_LINUX
+
+	inline void SignalEvent( int32_t fd )
 	{
-		if( len == 0 )
+		const uint64_t value = 1;
+		if( write( fd, &value, sizeof( value ) ) == -1 )
 		{
-			_DebugWarning(
-				"[Query] Bad OOB! len: %d from %s\n",
-				len,
-				IPToString( from.sin_addr )
-			);
-			return PacketType::Invalid;
+			_DebugWarning( "[Query] Failed to signal event %d (%d)\n", fd, errno );
 		}
+	}
 
-		if( len < 5 )
-			return PacketType::Good;
-
-		const int32_t channel = *reinterpret_cast<const int32_t *>( data );
-		if( channel == -2 )
+	inline void ClearEvent( int32_t fd )
+	{
+		uint64_t value = 0;
+		if( read( fd, &value, sizeof( value ) ) == -1 )
 		{
-			_DebugWarning(
-				"[Query] Bad OOB! len: %d, channel: 0x%X from %s\n",
-				len,
-				channel,
-				IPToString( from.sin_addr )
-			);
-			return PacketType::Invalid;
+			_DebugWarning( "[Query] Failed to clear event %d (%d)\n", fd, errno );
 		}
-
-		if( channel != -1 )
-			return PacketType::Good;
-
-		const uint8_t type = *( data + 4 );
-		if (type == 'U')
-			return PacketType::Player;
-
-		return type == 'T' ? PacketType::Info : PacketType::Good;
 	}
 
-	inline int32_t HandleNetError( int32_t value )
+#endif
+
+	inline void PushRepliesToQueue( std::vector<reply_t> &replies )
 	{
-		if( value == -1 )
+		if( replies.empty( ) )
+			return;
 
-#if defined SYSTEM_WINDOWS
+		bool receiver_replies = false;
+		{
+			AUTO_LOCK( reply_mutex );
+			for( reply_t &r : replies )
+				if( r.worker == nullptr )
+				{
+					reply_queue.emplace( std::move( r ) );
+					receiver_replies = true;
+				}
+		}
 
-			WSASetLastError( WSAEWOULDBLOCK );
+#if defined SYSTEM_LINUX
 
-#elif defined SYSTEM_POSIX
+		if( receiver_replies )
+			SignalEvent( threaded_socket_reply_event );
 
-			errno = EWOULDBLOCK;
+		// replies to the query port go back to the worker that received the query
+		for( reply_t &r : replies )
+			if( r.worker != nullptr )
+			{
+				query_worker_t &worker = *r.worker;
+				{
+					AUTO_LOCK( worker.reply_mutex );
+					worker.replies.emplace( std::move( r ) );
+				}
+
+				SignalEvent( worker.reply_event );
+			}
 
 #endif
 
-		return value;
 	}
 
-	inline bool IsPacketQueueFull( )
+	inline void PopRepliesFromQueue( std::queue<reply_t> &replies )
 	{
-		AUTO_LOCK( threaded_socket_mutex );
-		return threaded_socket_queue.size( ) >= threaded_socket_max_queue;
+		AUTO_LOCK( reply_mutex );
+		std::swap( replies, reply_queue );
 	}
 
-	inline bool PopPacketFromQueue( packet_t &p )
+	inline uint32_t GetMemoKey( const reply_memo_t &memo, const sockaddr_in &from )
 	{
-		AUTO_LOCK( threaded_socket_mutex );
+		if( memo.prefix == 0 )
+			return 0;
 
-		if( threaded_socket_queue.empty( ) )
-			return false;
+		const uint32_t mask = memo.prefix >= 32 ? 0xFFFFFFFF : ~( 0xFFFFFFFF >> memo.prefix );
+		return ntohl( from.sin_addr.s_addr ) & mask;
+	}
 
-		p = std::move( threaded_socket_queue.front( ) );
-		threaded_socket_queue.pop( );
-		return true;
+	static const memo_entry_t &GetMemoEntry(
+		reply_memo_t &memo,
+		const sockaddr_in &from,
+		double now,
+		payload_t ( *build )( const sockaddr_in & )
+	)
+	{
+		const uint32_t key = GetMemoKey( memo, from );
+		auto it = memo.entries.find( key );
+		if( it != memo.entries.end( ) )
+		{
+			const memo_entry_t &entry = ( *it ).second;
+			// the hook runs at most once per batch even with memoization disabled
+			if( entry.generation == memo.generation &&
+				( entry.batch == memo.batch || now < entry.expires ) )
+				return entry;
+		}
+		else if( memo.entries.size( ) >= memo_max_entries )
+		{
+			for( auto mit = memo.entries.begin( ); mit != memo.entries.end( ); )
+				if( ( *mit ).second.expires <= now || ( *mit ).second.generation != memo.generation )
+					mit = memo.entries.erase( mit );
+				else
+					++mit;
+
+			if( memo.entries.size( ) >= memo_max_entries )
+				memo.entries.clear( );
+		}
+
+		reply_snapshot_dirty = true;
+
+		memo_entry_t &entry = memo.entries[key];
+		entry.expires = now + memo.time;
+		entry.generation = memo.generation;
+		entry.batch = memo.batch;
+		entry.packet = build( from );
+		return entry;
 	}
 
-	inline void PushPacketToQueue( packet_t &&p )
+	inline void RecordHookCall( uint64_t start )
 	{
-		AUTO_LOCK( threaded_socket_mutex );
-		threaded_socket_queue.emplace( std::move( p ) );
+		main_stats.Add( Stat::HookCalls );
+		main_stats.Record( Stage::Hook, GetTimeNanoseconds( ) - start );
 	}
 
+	static payload_t BuildInfoReply( const sockaddr_in &from )
+	{
+		const uint64_t start = GetTimeNanoseconds( );
+		const HookResult result = CallInfoHook( from );
+		RecordHookCall( start );
+		if( result == HookResult::DontSend )
+			return nullptr;
+
+		if( result == HookResult::SendDefault )
+			return info_cache_payload;
+
+		return MakePayload(
+			info_hook_packet.GetData( ),
+			static_cast<size_t>( info_hook_packet.GetNumBytesWritten( ) )
+		);
+	}
+
+	static payload_t BuildRulesReply( const sockaddr_in &from )
+	{
+		std::vector<std::pair<std::string, std::string>> rules;
+		const uint64_t start = GetTimeNanoseconds( );
+		const bool dontsend = !CallRulesHook( from, rules );
+		RecordHookCall( start );
+		if( dontsend )
+			return nullptr;
+
+		BuildReplyRulesPacket( rules );
+
+		return MakePayload(
+			rules_cache_packet.GetData( ),
+			static_cast<size_t>( rules_cache_packet.GetNumBytesWritten( ) )
+		);
+	}
+
+	static void ProcessMemoizedQueries(
+		const std::vector<query_t> &queries,
+		std::vector<reply_t> &replies,
+		PacketType type,
+		reply_memo_t &memo,
+		payload_t ( *build )( const sockaddr_in & ),
+		double now
+	)
+	{
+		++memo.batch;
+		for( const query_t &q : queries )
+			if( q.type == type )
+			{
+				const memo_entry_t &entry = GetMemoEntry( memo, q.address, now, build );
+				if( !entry.packet )
+					continue;
+
+				replies.emplace_back( );
+				reply_t &r = replies.back( );
+				r.address = q.address;
+				r.buffer = entry.packet;
+				r.worker = q.worker;
+
+				_DebugWarning( "[Query] Handled %s request using cache\n", IPToString( q.address.sin_addr ) );
+			}
+	}
+
+	static void ProcessInfoQueries( const std::vector<query_t> &queries, std::vector<reply_t> &replies )
+	{
+		const double now = Plat_FloatTime( );
+		const uint32_t time = static_cast<uint32_t>( now );
+		if( time - info_cache_last_update >= info_cache_time )
+		{
+			BuildReplyInfo( );
+			info_cache_last_update = time;
+			info_cache_dirty = false;
+		}
+
+		ProcessMemoizedQueries( queries, replies, PacketType::Info, info_memo, BuildInfoReply, now );
+	}
+
+	static void ProcessRulesQueries( const std::vector<query_t> &queries, std::vector<reply_t> &replies )
+	{
+		const double now = Plat_FloatTime( );
+		const uint32_t time = static_cast<uint32_t>( now );
+		if( time - rules_cache_last_update >= info_cache_time )
+		{
+			BuildReplyRules( );
+			rules_cache_last_update = time;
+		}
+
+		ProcessMemoizedQueries( queries, replies, PacketType::Rules, rules_memo, BuildRulesReply, now );
+	}
+
+	// writes the player as the override changed it, returns false when it hid the player
+	static bool WriteOverriddenPlayer( uint8_t index, const char *name, double score, double time )
+	{
+		lua->ReferencePush( player_override_ref );
+		lua->PushNumber( index );
+		lua->PushString( name );
+		lua->PushNumber( score );
+		lua->PushNumber( time );
+		if( !lua->CallFunctionProtected( 4, 3, true ) )
+		{
+			WritePlayerReplyEntry( player_cache_packet, index, name, score, time );
+			return true;
+		}
+
+		if( lua->IsType( -3, GarrysMod::Lua::Type::Bool ) && !lua->GetBool( -3 ) )
+		{
+			lua->Pop( 3 );
+			return false;
+		}
+
+		// the name is only valid while it's on the stack
+		if( lua->IsType( -3, GarrysMod::Lua::Type::String ) )
+			name = lua->GetString( -3 );
+
+		if( lua->IsType( -2, GarrysMod::Lua::Type::Number ) )
+			score = lua->GetNumber( -2 );
+
+		if( lua->IsType( -1, GarrysMod::Lua::Type::Number ) )
+			time = lua->GetNumber( -1 );
+
+		WritePlayerReplyEntry( player_cache_packet, index, name, score, time );
+		lua->Pop( 3 );
+		return true;
+	}
+
+	static void BuildPlayerSnapshot( )
+	{
+		WritePlayerReplyHeader( player_cache_packet );
+
+		uint8_t written = 0;
+		const int32_t count = global::server->GetClientCount( );
+		for( int32_t k = 0; k < count && written < 255; ++k )
+		{
+			IClient *client = global::server->GetClient( k );
+			if( client == nullptr || !client->IsConnected( ) || client->IsHLTV( ) )
+				continue;
+
+			double score = 0.0;
+			if( playerinfo_manager != nullptr )
+			{
+				IPlayerInfo *info = playerinfo_manager->GetPlayerInfo(
+					engine_server->PEntityOfEntIndex( client->GetPlayerSlot( ) + 1 )
+				);
+				if( info != nullptr )
+					score = info->GetFragCount( );
+			}
+
+			double time = 0.0;
+			INetChannel *netchan = client->GetNetChannel( );
+			if( netchan != nullptr )
+				time = netchan->GetTimeConnected( );
+
+			if( player_override_ref == -1 )
+				WritePlayerReplyEntry( player_cache_packet, written, client->GetClientName( ), score, time );
+			else if( !WriteOverriddenPlayer( written, client->GetClientName( ), score, time ) )
+				continue;
+
+			++written;
+		}
+
+		WritePlayerReplyCount( player_cache_packet, written );
+
+		player_snapshot = MakePayload(
+			player_cache_packet.GetData( ),
+			static_cast<size_t>( player_cache_packet.GetNumBytesWritten( ) )
+		);
+		reply_snapshot_dirty = true;
+	}
+
+	static const payload_t &GetPlayerSnapshot( )
+	{
+		if( !player_snapshot )
+			BuildPlayerSnapshot( );
+
+		return player_snapshot;
+	}
+
+	static void ProcessPlayerQueries( const std::vector<query_t> &queries, std::vector<reply_t> &replies )
+	{
+		if( player_snapshot_enabled )
+		{
+			for( const query_t &q : queries )
+				if( q.type == PacketType::Player )
+				{
+					replies.emplace_back( );
+					reply_t &r = replies.back( );
+					r.address = q.address;
+					r.buffer = GetPlayerSnapshot( );
+					r.worker = q.worker;
+				}
+
+			return;
+		}
+
+		const query_t *first = nullptr;
+		for( const query_t &q : queries )
+			if( q.type == PacketType::Player )
+			{
+				first = &q;
+				break;
+			}
+
+		if( first == nullptr )
+			return;
+
+		const uint64_t start = GetTimeNanoseconds( );
+		const HookResult result = CallPlayerHook( first->address );
+		RecordHookCall( start );
+		if( result == HookResult::DontSend )
+			return; // dont send it
+
+		// the query carries our challenge which the engine would reject, so the default
+		// reply is the native list rather than handing the query back to the engine
+		const payload_t packet = result == HookResult::SendDefault ? GetPlayerSnapshot( ) : MakePayload(
+			player_cache_packet.GetData( ),
+			static_cast<size_t>( player_cache_packet.GetNumBytesWritten( ) )
+		);
+
+		for( const query_t &q : queries )
+			if( q.type == PacketType::Player )
+			{
+				replies.emplace_back( );
+				reply_t &r = replies.back( );
+				r.address = q.address;
+				r.worker = q.worker;
+				r.buffer = packet;
+			}
+	}
+
+	// memoized replies are only shared when they don't depend on the address
+	static void GetSharedMemoReply(
+		const reply_memo_t &memo,
+		double now,
+		uint64_t time,
+		payload_t &packet,
+		uint64_t &expires
+	)
+	{
+		if( memo.prefix != 0 )
+			return;
+
+		auto it = memo.entries.find( 0 );
+		if( it == memo.entries.end( ) )
+			return;
+
+		const memo_entry_t &entry = ( *it ).second;
+		if( entry.generation != memo.generation || !entry.packet || entry.expires <= now )
+			return;
+
+		packet = entry.packet;
+		expires = time + static_cast<uint64_t>( ( entry.expires - now ) * 1000000.0 );
+	}
+
+	// main thread only, the previous snapshot is deleted once the receiver is done with it
+	static void PublishReplySnapshot( )
+	{
+		reply_snapshot_dirty = false;
+
+		const double now = Plat_FloatTime( );
+		const uint64_t time = GetTimeMicroseconds( );
+		reply_snapshot_t *snapshot = new reply_snapshot_t( );
+
+		// query workers answer even with the detours off, the receiver checks them itself
+		GetSharedMemoReply( info_memo, now, time, snapshot->info, snapshot->info_expires );
+		GetSharedMemoReply( rules_memo, now, time, snapshot->rules, snapshot->rules_expires );
+
+		if( player_snapshot_enabled && player_snapshot )
+		{
+			// a second of slack so queries don't hit the main thread between refreshes
+			const double remaining = player_snapshot_last_update + player_snapshot_interval + 1.0 - now;
+			if( remaining > 0.0 )
+			{
+				snapshot->player = player_snapshot;
+				snapshot->player_expires = time + static_cast<uint64_t>( remaining * 1000000.0 );
+			}
+		}
+
+		reply_snapshot.Publish( snapshot );
+	}
+
+	// a player joined or left, the counts in the cached A2S_INFO reply are patched and the
+	// replies built from the old ones are dropped on the next ProcessQueries
+	LUA_FUNCTION_STATIC( MarkInfoDirty )
+	{
+		info_cache_dirty = true;
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( ProcessQueries )
+	{
+		// patched even without queries waiting, while the snapshot answers A2S_INFO none
+		// reach ProcessInfoQueries and the generation bump is what republishes it, a reply
+		// that wasn't built yet gets the current counts when it is
+		if( info_cache_dirty && info_cache_packet.GetNumBytesWritten( ) != 0 )
+		{
+			PatchReplyInfo( );
+			info_cache_dirty = false;
+		}
+
+		if( player_snapshot_enabled )
+		{
+			const double now = Plat_FloatTime( );
+			if( now - player_snapshot_last_update >= player_snapshot_interval )
+			{
+				BuildPlayerSnapshot( );
+				player_snapshot_last_update = now;
+			}
+		}
+
+		std::vector<query_t> queries;
+		std::vector<reply_t> replies;
+		queries.reserve( query_batch_size );
+		while( PopQueriesFromQueue( queries, query_batch_size ) != 0 )
+		{
+			ProcessInfoQueries( queries, replies );
+			ProcessPlayerQueries( queries, replies );
+			ProcessRulesQueries( queries, replies );
+			PushRepliesToQueue( replies );
+			queries.clear( );
+			replies.clear( );
+		}
+
+		if( reply_snapshot_dirty )
+			PublishReplySnapshot( );
+		else
+			reply_snapshot.Reclaim( );
+
+		return 0;
+	}
+
+	inline void SendReply( SOCKET socket, const sockaddr_in &to, const uint8_t *data, size_t len )
+	{
+		sendto(
+			socket,
+			reinterpret_cast<const char *>( data ),
+			static_cast<int32_t>( len ),
+			0,
+			reinterpret_cast<const sockaddr *>( &to ),
+			sizeof( to )
+		);
+	}
+
+	inline const uint8_t *GetBatchedReply( const send_batch_t &send_batch, size_t index, size_t &len )
+	{
+		const payload_t &payload = send_batch.payloads[index];
+		if( !payload )
+		{
+			len = send_batch.inline_lengths[index];
+			return send_batch.inline_buffers[index];
+		}
+
+		const size_t fragment = send_batch.fragments[index];
+		const size_t start = fragment != 0 ? payload->ends[fragment - 1] : 0;
+		len = payload->ends[fragment] - start;
+		return payload->buffer.data( ) + start;
+	}
+
+	static void FlushReplies( responder_t &responder )
+	{
+		send_batch_t &send_batch = responder.batch;
+		if( send_batch.count == 0 )
+			return;
+
+		const uint64_t start = GetTimeNanoseconds( );
+
+#if defined SYSTEM_LINUX
+
+		for( size_t k = 0; k < send_batch.count; ++k )
+		{
+			// replies sharing a cached payload all point at the same buffer
+			size_t len = 0;
+			const uint8_t *data = GetBatchedReply( send_batch, k, len );
+			send_batch.iovecs[k].iov_base = const_cast<uint8_t *>( data );
+			send_batch.iovecs[k].iov_len = len;
+
+			msghdr &hdr = send_batch.messages[k].msg_hdr;
+			std::memset( &hdr, 0, sizeof( hdr ) );
+			hdr.msg_name = &send_batch.addresses[k];
+			hdr.msg_namelen = sizeof( send_batch.addresses[k] );
+			hdr.msg_iov = &send_batch.iovecs[k];
+			hdr.msg_iovlen = 1;
+		}
+
+		size_t sent = 0;
+		while( sent < send_batch.count )
+		{
+			const int32_t res = sendmmsg(
+				responder.socket,
+				&send_batch.messages[sent],
+				static_cast<uint32_t>( send_batch.count - sent ),
+				0
+			);
+			if( res <= 0 )
+				break;
+
+			sent += static_cast<size_t>( res );
+		}
+
+		// sendmmsg stops at the first failing message, try the rest one by one
+		for( ; sent < send_batch.count; ++sent )
+		{
+			size_t len = 0;
+			const uint8_t *data = GetBatchedReply( send_batch, sent, len );
+			SendReply( responder.socket, send_batch.addresses[sent], data, len );
+		}
+
+#else
+
+		for( size_t k = 0; k < send_batch.count; ++k )
+		{
+			size_t len = 0;
+			const uint8_t *data = GetBatchedReply( send_batch, k, len );
+			SendReply( responder.socket, send_batch.addresses[k], data, len );
+		}
+
+#endif
+
+		for( size_t k = 0; k < send_batch.count; ++k )
+			send_batch.payloads[k].reset( );
+
+		responder.stats->Add( Stat::RepliesSent, send_batch.count );
+		responder.stats->Record( Stage::Send, GetTimeNanoseconds( ) - start );
+		send_batch.count = 0;
+	}
+
+	inline void QueueReply( responder_t &responder, const sockaddr_in &to, const payload_t &payload )
+	{
+		send_batch_t &send_batch = responder.batch;
+		for( size_t k = 0; k < payload->ends.size( ); ++k )
+		{
+			if( send_batch.count >= send_batch_max )
+				FlushReplies( responder );
+
+			send_batch.addresses[send_batch.count] = to;
+			send_batch.payloads[send_batch.count] = payload;
+			send_batch.fragments[send_batch.count] = k;
+			++send_batch.count;
+		}
+	}
+
+	// small replies are copied into the batch itself so they don't need a shared payload
+	inline void QueueReply( responder_t &responder, const sockaddr_in &to, const uint8_t *data, size_t len )
+	{
+		if( len > send_batch_inline_max )
+		{
+			QueueReply( responder, to, MakePayload( data, len ) );
+			return;
+		}
+
+		send_batch_t &send_batch = responder.batch;
+		if( send_batch.count >= send_batch_max )
+			FlushReplies( responder );
+
+		send_batch.addresses[send_batch.count] = to;
+		send_batch.payloads[send_batch.count].reset( );
+		std::memcpy( send_batch.inline_buffers[send_batch.count], data, len );
+		send_batch.inline_lengths[send_batch.count] = len;
+		++send_batch.count;
+	}
+
+	// receiver thread, answers with the latest published snapshot if it's still fresh
+	static bool AnswerFromSnapshot( responder_t &responder, const sockaddr_in &from, PacketType type )
+	{
+		const reply_snapshot_t *snapshot = reply_snapshot.Enter( responder.snapshot_reader );
+		bool answered = false;
+		if( snapshot != nullptr )
+		{
+			const payload_t *packet = &snapshot->info;
+			uint64_t expires = snapshot->info_expires;
+			if( type == PacketType::Player )
+			{
+				packet = &snapshot->player;
+				expires = snapshot->player_expires;
+			}
+			else if( type == PacketType::Rules )
+			{
+				packet = &snapshot->rules;
+				expires = snapshot->rules_expires;
+			}
+
+			if( *packet && GetTimeMicroseconds( ) < expires )
+			{
+				QueueReply( responder, from, *packet );
+				responder.stats->Add( Stat::SnapshotReplies );
+				answered = true;
+			}
+		}
+
+		reply_snapshot.Leave( responder.snapshot_reader );
+		return answered;
+	}
+
+	inline void SendChallenge( responder_t &responder, const sockaddr_in &from, uint64_t time )
+	{
+		uint8_t reply[9] = { 0xFF, 0xFF, 0xFF, 0xFF, 'A' }; // S2C_CHALLENGE
+		const uint32_t challenge = challenge_manager.GetChallenge( from.sin_addr.s_addr, time );
+		std::memcpy( reply + 5, &challenge, sizeof( challenge ) );
+		QueueReply( responder, from, reply, sizeof( reply ) );
+		responder.stats->Add( Stat::ChallengesSent );
+
+		_DebugWarning( "[Query] Sent challenge to %s\n", IPToString( from.sin_addr ) );
+	}
+
+	// only packets carrying one of our challenges are handled here, callers answer these
+	// queries themselves so unchallenged ones and ones carrying a challenge we didn't
+	// issue (stale, the engine's or made up) get a fresh challenge back and nothing else,
+	// a spoofed flood never gets past this hash to the limiter, the hooks or the engine
+	inline bool FilterQueryChallenge(
+		responder_t &responder,
+		const uint8_t *data,
+		int32_t len,
+		int32_t offset,
+		const sockaddr_in &from
+	)
+	{
+		const uint64_t time = GetTimeMicroseconds( );
+		switch( CheckQueryChallenge( challenge_manager, data, len, offset, from.sin_addr.s_addr, time ) )
+		{
+		case ChallengeStatus::Valid:
+			return true;
+
+		default:
+			SendChallenge( responder, from, time );
+			return false;
+		}
+	}
+
+	inline void QueueQuery( responder_t &responder, query_t &&q )
+	{
+		size_t depth = 0;
+		if( !PushQueryToQueue( std::move( q ), depth ) )
+		{
+			_DebugWarning( "[Query] Query queue is full, dropping request from %s\n", IPToString( q.address.sin_addr ) );
+			responder.stats->Add( Stat::QueryQueueFull );
+			return;
+		}
+
+		responder.stats->Add( Stat::QueuedQueries );
+		responder.stats->Observe( Peak::QueryQueue, depth );
+	}
+
+	// the query port has nobody else to answer
+	inline query_policy_t GetQueryPolicy( const responder_t &responder )
+	{
+		query_policy_t policy;
+		policy.info_answered = info_cache_enabled.load( std::memory_order_relaxed ) || responder.worker != nullptr;
+		policy.rules_answered = rules_cache_enabled.load( std::memory_order_relaxed ) || responder.worker != nullptr;
+		policy.info_challenge = info_challenge_enabled.load( std::memory_order_relaxed );
+		policy.player_challenge = player_challenge_enabled.load( std::memory_order_relaxed );
+		return policy;
+	}
+
+	// any connectionless packet that isn't banned, the decisions live in packet.hpp so the
+	// replay benchmark makes the same ones
+	static PacketType HandleQuery(
+		responder_t &responder,
+		PacketHeader header,
+		const uint8_t *data,
+		int32_t len,
+		const sockaddr_in &from
+	)
+	{
+		const query_policy_t policy = GetQueryPolicy( responder );
+		const int32_t offset = GetChallengeOffset( header, policy );
+		if( offset >= 0 && !FilterQueryChallenge( responder, data, len, offset, from ) )
+			return PacketType::Invalid;
+
+		if( !responder.clients->CheckIPRate( ntohl( from.sin_addr.s_addr ), GetQueryType( header ), GetTimeMicroseconds( ) ) )
+		{
+			_DebugWarning( "[Query] Client %s hit rate limit\n", IPToString( from.sin_addr ) );
+			responder.stats->Add( Stat::RateLimited );
+			return PacketType::Invalid;
+		}
+
+		if( !IsAnsweredQuery( header, policy ) )
+			return PacketType::Good;
+
+		const PacketType type = header == PacketHeader::Info ? PacketType::Info :
+			header == PacketHeader::Player ? PacketType::Player : PacketType::Rules;
+		if( AnswerFromSnapshot( responder, from, type ) )
+			return PacketType::Invalid;
+
+		query_t q;
+		q.address = from;
+		q.type = type;
+		q.worker = responder.worker;
+		QueueQuery( responder, std::move( q ) );
+
+		return PacketType::Invalid; // we've handled it
+	}
+
+	static PacketType ClassifyPacket( responder_t &responder, const uint8_t *data, int32_t len, const sockaddr_in &from )
+	{
+		const PacketHeader header = ParsePacketHeader( data, len );
+		if( header == PacketHeader::Malformed )
+		{
+			_DebugWarning( "[Query] Bad OOB! len: %d from %s\n", len, IPToString( from.sin_addr ) );
+			responder.stats->Add( Stat::MalformedPackets );
+			return PacketType::Invalid;
+		}
+
+		if( header == PacketHeader::Connected )
+			return PacketType::Good;
+
+		if( IsBannedPacket( client_manager, header, ntohl( from.sin_addr.s_addr ), GetTimeMicroseconds( ) ) )
+		{
+			responder.stats->Add( Stat::BannedPackets );
+			return PacketType::Invalid;
+		}
+
+		if( header == PacketHeader::Info )
+			return PacketType::Info;
+
+		if( header == PacketHeader::Player )
+			return PacketType::Player;
+
+		if( header == PacketHeader::Rules )
+			return PacketType::Rules;
+
+		return HandleQuery( responder, header, data, len, from );
+	}
+
+	inline int32_t HandleNetError( int32_t value )
+	{
+		if( value == -1 )
+
+#if defined SYSTEM_WINDOWS
+
+			WSASetLastError( WSAEWOULDBLOCK );
+
+#elif defined SYSTEM_POSIX
+
+			errno = EWOULDBLOCK;
+
+#endif
+
+		return value;
+	}
+
+	inline bool IsPacketQueueFull( )
+	{
+		return threaded_socket_queue.Space( ) == 0;
+	}
+
+	inline size_t GetPacketQueueSpace( )
+	{
+		return threaded_socket_queue.Space( );
+	}
+
+	inline void PopPacketFromQueue( )
+	{
+		threaded_socket_queue.Pop( );
+
+#if defined SYSTEM_LINUX
+
+		std::atomic_thread_fence( std::memory_order_seq_cst );
+		if( threaded_socket_waiting.load( std::memory_order_relaxed ) &&
+			threaded_socket_waiting.exchange( false ) )
+			SignalEvent( threaded_socket_space_event );
+
+#endif
+
+	}
+
+	inline uint32_t GetPacketTypeBit( PacketType type )
+	{
+		return 1u << ( static_cast<int32_t>( type ) + 1 );
+	}
+
+	static void SamplePacket(
+		responder_t &responder,
+		const uint8_t *buffer,
+		int32_t len,
+		const sockaddr_in &from,
+		PacketType type,
+		bool passed
+	)
+	{
+		packet_sample_t header;
+		header.time = static_cast<uint64_t>( std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::system_clock::now( ).time_since_epoch( )
+		).count( ) );
+		header.source_address = from.sin_addr.s_addr;
+		header.source_port = from.sin_port;
+		header.destination_address = responder.address.sin_addr.s_addr;
+		header.destination_port = responder.address.sin_port;
+		header.type = static_cast<int32_t>( type );
+		header.passed = passed;
+		packet_sampler.Add( header, buffer, static_cast<size_t>( std::max( len, 0 ) ) );
+	}
+
+	static bool AnalyzePacket( responder_t &responder, const uint8_t *buffer, int32_t len, const sockaddr_in &from )
+	{
+		_DebugWarning( "[Query] Address %s was allowed\n", IPToString( from.sin_addr ) );
+
+		ThreadStats &stats = *responder.stats;
+		const uint64_t start = GetTimeNanoseconds( );
+		stats.Add( Stat::PacketsReceived );
+
+		PacketType type = ClassifyPacket( responder, buffer, len, from );
+		const PacketType classified = type;
+		if( type == PacketType::Info )
+		{
+			stats.Add( Stat::InfoQueries );
+			type = HandleQuery( responder, PacketHeader::Info, buffer, len, from );
+		}
+
+		if( type == PacketType::Player )
+		{
+			stats.Add( Stat::PlayerQueries );
+			type = HandleQuery( responder, PacketHeader::Player, buffer, len, from );
+		}
+
+		if( type == PacketType::Rules )
+		{
+			stats.Add( Stat::RulesQueries );
+			type = HandleQuery( responder, PacketHeader::Rules, buffer, len, from );
+		}
+
+		const bool passed = type != PacketType::Invalid;
+		stats.Add( passed ? Stat::PacketsPassed : Stat::PacketsDropped );
+		stats.Record( Stage::Classify, GetTimeNanoseconds( ) - start );
+
+		if( packet_sampler.ShouldSample( responder.sample_countdown, GetPacketTypeBit( classified ) ) )
+			SamplePacket( responder, buffer, len, from, classified, passed );
+
+		return passed;
+	}
+
+	// live entries are only known to the thread owning the shard, which also frees the
+	// timed out ones here
+	inline void UpdateShardStats( responder_t &responder )
+	{
+		ClientShard &clients = *responder.clients;
+		clients.Sweep( GetTimeMicroseconds( ) );
+		responder.stats->Set( Gauge::Clients, clients.GetClientCount( ) );
+		responder.stats->Set( Gauge::Subnets24, clients.GetSubnetCount( 24 ) );
+		responder.stats->Set( Gauge::Subnets16, clients.GetSubnetCount( 16 ) );
+	}
+
+#if !defined SYSTEM_LINUX
+
+	static ssize_t ReceiveAndAnalyzePacket(
+		SOCKET s,
+		void *buf,
+		recvlen_t buflen,
+		int32_t flags,
+		sockaddr *from,
+		socklen_t *fromlen
+	)
+	{
+		auto trampoline = recvfrom_hook.GetTrampoline<recvfrom_t>( );
+		if( trampoline == nullptr )
+			return -1;
+
+		const uint64_t start = GetTimeNanoseconds( );
+		const ssize_t len = trampoline( s, buf, buflen, flags, from, fromlen );
+		receiver.stats->Record( Stage::Receive, GetTimeNanoseconds( ) - start );
+		_DebugWarning( "[Query] Called recvfrom on socket %d and received %d bytes\n", s, len );
+		if( len == -1 )
+			return -1;
+
+		const uint8_t *buffer = reinterpret_cast<uint8_t *>( buf );
+		const sockaddr_in &infrom = *reinterpret_cast<sockaddr_in *>( from );
+		return AnalyzePacket( receiver, buffer, static_cast<int32_t>( len ), infrom ) ? len : -1;
+	}
+
+#endif
+
+	static ssize_t SERVERSECURE_CALLING_CONVENTION recvfrom_detour(
+		SOCKET s,
+		void *buf,
+		recvlen_t buflen,
+		int32_t flags,
+		sockaddr *from,
+		socklen_t *fromlen
+	)
+	{
+		if( s != game_socket )
+		{
+			_DebugWarning( "[Query] recvfrom detour called with socket %d, passing through\n", s );
+			auto trampoline = recvfrom_hook.GetTrampoline<recvfrom_t>( );
+			return trampoline != nullptr ? trampoline( s, buf, buflen, flags, from, fromlen ) : -1;
+		}
+
+		//_DebugWarning( "[Query] recvfrom detour called with socket %d, detouring\n", s );
+
+		if( threaded_socket_queue.Empty( ) )
+			return HandleNetError( -1 );
+
+		const packet_t &p = threaded_socket_queue.Front( );
+
+		const ssize_t len = std::min( static_cast<ssize_t>( p.length ), static_cast<ssize_t>( buflen ) );
+		std::memcpy( buf, p.buffer.get( ), static_cast<size_t>( len ) );
+
+		const socklen_t addrlen = std::min( *fromlen, p.address_size );
+		std::memcpy( from, &p.address, static_cast<size_t>( addrlen ) );
+		*fromlen = addrlen;
+
+		PopPacketFromQueue( );
+		return len;
+	}
+
+	static void SendQueuedReplies( )
+	{
+		static std::queue<reply_t> replies;
+		PopRepliesFromQueue( replies );
+		while( !replies.empty( ) )
+		{
+			QueueReply( receiver, replies.front( ).address, replies.front( ).buffer );
+			replies.pop( );
+		}
+
+		FlushReplies( receiver );
+	}
+
+#if defined SYSTEM_LINUX
+
+	// recvmmsg writes straight into the free slots of the packet queue (up to
+	// threaded_socket_max_batch), packets meant for the engine are then moved down over
+	// the ones we handled or dropped by swapping slot buffers, so only they use up queue
+	// space and the freed slots are handed to the next recvmmsg
+	static void ReceivePacketBatch( )
+	{
+		static iovec iovecs[threaded_socket_max_batch];
+		static mmsghdr messages[threaded_socket_max_batch];
+
+		const size_t count = std::min( GetPacketQueueSpace( ), threaded_socket_max_batch );
+		if( count == 0 )
+			return;
+
+		for( size_t k = 0; k < count; ++k )
+		{
+			packet_t &p = threaded_socket_queue.Back( k );
+			iovecs[k].iov_base = p.buffer.get( );
+			iovecs[k].iov_len = threaded_socket_max_buffer;
+
+			msghdr &hdr = messages[k].msg_hdr;
+			std::memset( &hdr, 0, sizeof( hdr ) );
+			hdr.msg_name = &p.address;
+			hdr.msg_namelen = sizeof( p.address );
+			hdr.msg_iov = &iovecs[k];
+			hdr.msg_iovlen = 1;
+			messages[k].msg_len = 0;
+		}
+
+		const uint64_t start = GetTimeNanoseconds( );
+		const int32_t received = recvmmsg(
+			game_socket, messages, static_cast<uint32_t>( count ), MSG_DONTWAIT, nullptr
+		);
+		receiver.stats->Record( Stage::Receive, GetTimeNanoseconds( ) - start );
+		_DebugWarning( "[Query] Called recvmmsg on socket %d and received %d packets\n", game_socket, received );
+		if( received <= 0 )
+			return;
+
+		size_t pushed = 0;
+		for( int32_t k = 0; k < received; ++k )
+		{
+			packet_t &p = threaded_socket_queue.Back( static_cast<size_t>( k ) );
+			p.address_size = messages[k].msg_hdr.msg_namelen;
+			p.length = messages[k].msg_len;
+			if( !AnalyzePacket( receiver, p.buffer.get( ), static_cast<int32_t>( p.length ), p.address ) )
+				continue;
+
+			if( pushed != static_cast<size_t>( k ) )
+			{
+				packet_t &kept = threaded_socket_queue.Back( pushed );
+				kept.address = p.address;
+				kept.address_size = p.address_size;
+				kept.length = p.length;
+				kept.buffer.swap( p.buffer );
+			}
+
+			++pushed;
+		}
+
+		_DebugWarning( "[Query] Pushing %d packets to queue\n", static_cast<int32_t>( pushed ) );
+
+		threaded_socket_queue.Push( pushed );
+		receiver.stats->Observe( Peak::PacketQueue, threaded_socket_max_queue - GetPacketQueueSpace( ) );
+		UpdateShardStats( receiver );
+	}
+
+#endif
+
+#if defined SYSTEM_LINUX
+
+	static uintp PacketReceiverThread( void * )
+	{
+		epoll_event events[4];
+		while( threaded_socket_execute )
+		{
+			SendQueuedReplies( );
+
+			bool full = IsPacketQueueFull( );
+			if( full )
+			{
+				threaded_socket_waiting = true;
+				std::atomic_thread_fence( std::memory_order_seq_cst );
+				// the engine may have freed slots before it could see we were waiting
+				full = IsPacketQueueFull( );
+				if( !full )
+				{
+					threaded_socket_waiting = false;
+				}
+				else
+				{
+					_DebugWarning( "[Query] Packet queue is full, waiting for free slots\n" );
+					receiver.stats->Add( Stat::PacketQueueFull );
+				}
+			}
+
+			const int32_t count = epoll_wait(
+				full ? threaded_socket_full_epoll : threaded_socket_epoll, events, 4, -1
+			);
+			if( count == -1 )
+				continue;
+
+			bool readable = false;
+			for( int32_t k = 0; k < count; ++k )
+			{
+				const int32_t fd = events[k].data.fd;
+				if( fd == game_socket )
+					readable = true;
+				else
+					ClearEvent( fd );
+			}
+
+			if( readable && threaded_socket_execute )
+			{
+				ReceivePacketBatch( );
+				FlushReplies( receiver ); // challenges sent while classifying
+			}
+		}
+
+		return 0;
+	}
+
+	static bool CreateReceiverEvents( )
+	{
+		threaded_socket_shutdown_event = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+		threaded_socket_space_event = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+		threaded_socket_reply_event = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+		threaded_socket_epoll = epoll_create1( EPOLL_CLOEXEC );
+		threaded_socket_full_epoll = epoll_create1( EPOLL_CLOEXEC );
+		if( threaded_socket_shutdown_event == -1 || threaded_socket_space_event == -1 ||
+			threaded_socket_reply_event == -1 || threaded_socket_epoll == -1 ||
+			threaded_socket_full_epoll == -1 )
+			return false;
+
+		const int32_t events[] = {
+			threaded_socket_shutdown_event,
+			threaded_socket_space_event,
+			threaded_socket_reply_event
+		};
+		for( const int32_t fd : events )
+		{
+			epoll_event ev = { };
+			ev.events = EPOLLIN;
+			ev.data.fd = fd;
+			if( epoll_ctl( threaded_socket_epoll, EPOLL_CTL_ADD, fd, &ev ) == -1 ||
+				epoll_ctl( threaded_socket_full_epoll, EPOLL_CTL_ADD, fd, &ev ) == -1 )
+				return false;
+		}
+
+		// the game socket is only watched while there is room in the packet queue
+		epoll_event ev = { };
+		ev.events = EPOLLIN;
+		ev.data.fd = game_socket;
+		return epoll_ctl( threaded_socket_epoll, EPOLL_CTL_ADD, game_socket, &ev ) != -1;
+	}
+
+	static void DestroyReceiverEvents( )
+	{
+		int32_t *fds[] = {
+			&threaded_socket_epoll,
+			&threaded_socket_full_epoll,
+			&threaded_socket_shutdown_event,
+			&threaded_socket_space_event,
+			&threaded_socket_reply_event
+		};
+		for( int32_t *fd : fds )
+			if( *fd != -1 )
+			{
+				close( *fd );
+				*fd = -1;
+			}
+	}
+
+	static SOCKET CreateQueryWorkerSocket( uint16_t port )
+	{
+		const SOCKET s = socket( AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+		if( s == INVALID_SOCKET )
+			return INVALID_SOCKET;
+
+		sockaddr_in address = { };
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl( INADDR_ANY );
+		address.sin_port = htons( port );
+
+		const int32_t enable = 1;
+		if( setsockopt( s, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof( enable ) ) == -1 ||
+			bind( s, reinterpret_cast<const sockaddr *>( &address ), sizeof( address ) ) == -1 )
+		{
+			_DebugWarning( "[Query] Failed to bind query port %d (%d)\n", port, errno );
+			close( s );
+			return INVALID_SOCKET;
+		}
+
+		return s;
+	}
+
+	// by default SO_REUSEPORT hashes the whole 4-tuple, so a source rotating its ports
+	// would reach every worker and get each one's per address budget, instead return
+	// hash( source /16 ) % count as the index of the socket in the reuseport group
+	// (sockets are indexed in bind order), hashing the /16 rather than the address keeps
+	// the /24 and /16 limits and their auto bans within one shard too, the kernel falls
+	// back to its own hash when the index is past the sockets bound so far
+	static bool AttachQueryWorkerSelector( SOCKET s, size_t count )
+	{
+
+#if defined SO_ATTACH_REUSEPORT_CBPF
+
+		sock_filter code[] = {
+			BPF_STMT( BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>( SKF_NET_OFF + 12 ) ), // IPv4 source
+			BPF_STMT( BPF_ALU | BPF_RSH | BPF_K, 16 ),
+			BPF_STMT( BPF_ALU | BPF_MUL | BPF_K, 2654435769u ),
+			BPF_STMT( BPF_ALU | BPF_RSH | BPF_K, 16 ),
+			BPF_STMT( BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>( count ) ),
+			BPF_STMT( BPF_RET | BPF_A, 0 )
+		};
+		sock_fprog program = { static_cast<unsigned short>( sizeof( code ) / sizeof( *code ) ), code };
+		return setsockopt( s, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof( program ) ) != -1;
+
+#else
+
+		( void )s;
+		( void )count;
+		return false;
+
+#endif
+
+	}
+
+	static void SendWorkerReplies( query_worker_t &worker )
+	{
+		std::queue<reply_t> replies;
+		{
+			AUTO_LOCK( worker.reply_mutex );
+			std::swap( replies, worker.replies );
+		}
+
+		for( ; !replies.empty( ); replies.pop( ) )
+			QueueReply( worker.responder, replies.front( ).address, replies.front( ).buffer );
+	}
+
+	// returns true when the batch was full and more packets may be waiting
+	static bool ReceiveWorkerBatch( query_worker_t &worker )
+	{
+		for( size_t k = 0; k < threaded_socket_max_batch; ++k )
+		{
+			packet_t &p = worker.packets[k];
+			worker.iovecs[k].iov_base = p.buffer.get( );
+			worker.iovecs[k].iov_len = threaded_socket_max_buffer;
+
+			msghdr &hdr = worker.messages[k].msg_hdr;
+			std::memset( &hdr, 0, sizeof( hdr ) );
+			hdr.msg_name = &p.address;
+			hdr.msg_namelen = sizeof( p.address );
+			hdr.msg_iov = &worker.iovecs[k];
+			hdr.msg_iovlen = 1;
+			worker.messages[k].msg_len = 0;
+		}
+
+		const uint64_t start = GetTimeNanoseconds( );
+		const int32_t received = recvmmsg(
+			worker.responder.socket,
+			worker.messages,
+			static_cast<uint32_t>( threaded_socket_max_batch ),
+			MSG_DONTWAIT,
+			nullptr
+		);
+		worker.responder.stats->Record( Stage::Receive, GetTimeNanoseconds( ) - start );
+		if( received <= 0 )
+			return false;
+
+		// nothing on the query port is meant for the engine, unhandled packets are dropped
+		for( int32_t k = 0; k < received; ++k )
+		{
+			const packet_t &p = worker.packets[k];
+			AnalyzePacket(
+				worker.responder,
+				p.buffer.get( ),
+				static_cast<int32_t>( worker.messages[k].msg_len ),
+				p.address
+			);
+		}
+
+		UpdateShardStats( worker.responder );
+		return static_cast<size_t>( received ) == threaded_socket_max_batch;
+	}
+
+	static uintp QueryWorkerThread( void *param )
+	{
+		query_worker_t &worker = *static_cast<query_worker_t *>( param );
+
+		pollfd fds[3] = { };
+		fds[0].fd = worker.responder.socket;
+		fds[1].fd = worker.reply_event;
+		fds[2].fd = query_workers_shutdown_event;
+		for( pollfd &fd : fds )
+			fd.events = POLLIN;
+
+		while( query_workers_execute )
+		{
+			if( poll( fds, 3, -1 ) == -1 )
+				continue;
+
+			if( fds[1].revents != 0 )
+			{
+				ClearEvent( worker.reply_event );
+				SendWorkerReplies( worker );
+			}
+
+			if( fds[0].revents != 0 )
+				while( query_workers_execute && ReceiveWorkerBatch( worker ) )
+					FlushReplies( worker.responder );
+
+			FlushReplies( worker.responder );
+		}
+
+		return 0;
+	}
+
+	static void StopQueryWorkerPool( )
+	{
+		if( query_workers.empty( ) && query_workers_shutdown_event == -1 )
+			return;
+
+		query_workers_execute = false;
+		if( query_workers_shutdown_event != -1 )
+			SignalEvent( query_workers_shutdown_event );
+
+		for( std::unique_ptr<query_worker_t> &worker : query_workers )
+			if( worker->thread != nullptr )
+			{
+				ThreadJoin( worker->thread );
+				ReleaseThreadHandle( worker->thread );
+				worker->thread = nullptr;
+			}
+
+		// queries still waiting for the main thread would be answered through a dead worker
+		{
+			AUTO_LOCK( query_mutex );
+			std::queue<query_t> kept;
+			for( ; !query_queue.empty( ); query_queue.pop( ) )
+				if( query_queue.front( ).worker == nullptr )
+					kept.emplace( std::move( query_queue.front( ) ) );
+
+			std::swap( kept, query_queue );
+		}
+
+		for( std::unique_ptr<query_worker_t> &worker : query_workers )
+		{
+			if( worker->responder.socket != INVALID_SOCKET )
+				close( worker->responder.socket );
+
+			if( worker->reply_event != -1 )
+				close( worker->reply_event );
+		}
+
+		query_workers.clear( );
+
+		if( query_workers_shutdown_event != -1 )
+		{
+			close( query_workers_shutdown_event );
+			query_workers_shutdown_event = -1;
+		}
+	}
+
+	static bool StartQueryWorkerPool( uint16_t port, size_t count )
+	{
+		StopQueryWorkerPool( );
+
+		query_workers_shutdown_event = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+		if( query_workers_shutdown_event == -1 )
+			return false;
+
+		query_workers_execute = true;
+		for( size_t k = 0; k < count; ++k )
+		{
+			query_workers.emplace_back( new query_worker_t( ) );
+			query_worker_t &worker = *query_workers.back( );
+
+			responder_t &responder = worker.responder;
+			responder.socket = CreateQueryWorkerSocket( port );
+			responder.snapshot_reader = 1 + k;
+			responder.clients = &worker.clients;
+			responder.worker = &worker;
+			responder.stats = &stats_registry.Get( 2 + k );
+			responder.address = { };
+			responder.address.sin_family = AF_INET;
+			responder.address.sin_port = htons( port );
+			responder.sample_countdown = 0;
+			responder.batch.count = 0;
+
+			worker.reply_event = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+			if( responder.socket == INVALID_SOCKET || worker.reply_event == -1 )
+			{
+				StopQueryWorkerPool( );
+				return false;
+			}
+
+			// the program belongs to the whole reuseport group, attaching it once is enough
+			if( k == 0 && !AttachQueryWorkerSelector( responder.socket, count ) )
+			{
+				_DebugWarning(
+					"[Query] Failed to attach the query worker selector (%d), per address and "
+					"subnet limits are multiplied by the number of workers\n",
+					errno
+				);
+			}
+
+			worker.thread = CreateSimpleThread( QueryWorkerThread, &worker );
+			if( worker.thread == nullptr )
+			{
+				StopQueryWorkerPool( );
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+#else
+
+	static uintp PacketReceiverThread( void * )
+	{
+		while( threaded_socket_execute )
+		{
+			SendQueuedReplies( );
+
+			if( IsPacketQueueFull( ) )
+			{
+				_DebugWarning( "[Query] Packet queue is full, sleeping for 10ms\n" );
+				receiver.stats->Add( Stat::PacketQueueFull );
+				ThreadSleep( 10 );
+				continue;
+			}
+
+			fd_set readables;
+			FD_ZERO( &readables );
+			FD_SET( game_socket, &readables );
+			// short timeout so replies built on the main thread don't wait long to be sent
+			timeval timeout = { 0, 10000 };
+			const int32_t res = select( game_socket + 1, &readables, nullptr, nullptr, &timeout );
+			if( res == -1 || !FD_ISSET( game_socket, &readables ) )
+				continue;
+
+			_DebugWarning( "[Query] Select passed\n" );
+
+			packet_t &p = threaded_socket_queue.Back( );
+			p.address_size = sizeof( p.address );
+			const ssize_t len = ReceiveAndAnalyzePacket(
+				game_socket,
+				p.buffer.get( ),
+				static_cast<recvlen_t>( threaded_socket_max_buffer ),
+				0,
+				reinterpret_cast<sockaddr *>( &p.address ),
+				&p.address_size
+			);
+			FlushReplies( receiver ); // challenges sent while classifying
+			UpdateShardStats( receiver );
+			if( len == -1 )
+				continue;
+
+			_DebugWarning( "[Query] Pushing packet to queue\n" );
+
+			p.length = static_cast<size_t>( len );
+			threaded_socket_queue.Push( );
+			receiver.stats->Observe( Peak::PacketQueue, threaded_socket_max_queue - GetPacketQueueSpace( ) );
+		}
+
+		return 0;
+	}
+
+#endif
+
+	LUA_FUNCTION_STATIC( EnableInfoCache )
+	{
+		LUA->CheckType( 1, GarrysMod::Lua::Type::Bool );
+		info_cache_enabled.store( LUA->GetBool( 1 ), std::memory_order_relaxed );
+		PublishReplySnapshot( );
+		return 0;
+	}
+
+	inline void SetHookCacheTime( GarrysMod::Lua::ILuaBase *LUA, reply_memo_t &memo )
+	{
+		const double time = LUA->CheckNumber( 1 );
+		if( time < 0.0 )
+			LUA->ArgError( 1, "cache time must not be negative" );
+
+		memo.time = time;
+		++memo.generation;
+		PublishReplySnapshot( );
+	}
+
+	inline void SetHookVariantPrefix( GarrysMod::Lua::ILuaBase *LUA, reply_memo_t &memo )
+	{
+		const int32_t bits = static_cast<int32_t>( LUA->CheckNumber( 1 ) );
+		if( bits < 0 || bits > 32 )
+			LUA->ArgError( 1, "prefix length must be between 0 and 32" );
+
+		memo.prefix = static_cast<uint32_t>( bits );
+		memo.entries.clear( );
+		PublishReplySnapshot( );
+	}
+
+	LUA_FUNCTION_STATIC( SetInfoHookCacheTime )
+	{
+		SetHookCacheTime( LUA, info_memo );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( SetInfoHookVariantPrefix )
+	{
+		SetHookVariantPrefix( LUA, info_memo );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( InvalidateInfoHookCache )
+	{
+		++info_memo.generation;
+		PublishReplySnapshot( );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( EnableNativePlayerReply )
+	{
+		LUA->CheckType( 1, GarrysMod::Lua::Type::Bool );
+		player_snapshot_enabled = LUA->GetBool( 1 );
+		player_snapshot.reset( );
+		player_snapshot_last_update = 0.0;
+		PublishReplySnapshot( );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( SetPlayerSnapshotInterval )
+	{
+		const double interval = LUA->CheckNumber( 1 );
+		if( interval < 0.0 )
+			LUA->ArgError( 1, "interval must not be negative" );
+
+		player_snapshot_interval = interval;
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( SetPlayerOverride )
+	{
+		if( player_override_ref != -1 )
+		{
+			LUA->ReferenceFree( player_override_ref );
+			player_override_ref = -1;
+		}
+
+		if( !LUA->IsType( 1, GarrysMod::Lua::Type::Nil ) )
+		{
+			LUA->CheckType( 1, GarrysMod::Lua::Type::Function );
+			LUA->Push( 1 );
+			player_override_ref = LUA->ReferenceCreate( );
+		}
+
+		player_snapshot.reset( );
+		PublishReplySnapshot( );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( EnableRulesDetour )
+	{
+		LUA->CheckType( 1, GarrysMod::Lua::Type::Bool );
+		rules_cache_enabled.store( LUA->GetBool( 1 ), std::memory_order_relaxed );
+		PublishReplySnapshot( );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( SetRulesConVars )
+	{
+		LUA->CheckType( 1, GarrysMod::Lua::Type::Table );
+
+		std::vector<std::string> names;
+		const int32_t count = LUA->ObjLen( 1 );
+		for( int32_t k = 1; k <= count; ++k )
+		{
+			LUA->PushNumber( k );
+			LUA->GetTable( 1 );
+			if( LUA->IsType( -1, GarrysMod::Lua::Type::String ) )
+				names.emplace_back( LUA->GetString( -1 ) );
+
+			LUA->Pop( 1 );
+		}
+
+		rules_convars = std::move( names );
+		BuildReplyRules( );
+		rules_cache_last_update = static_cast<uint32_t>( Plat_FloatTime( ) );
+		++rules_memo.generation;
+		PublishReplySnapshot( );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( SetRulesHookCacheTime )
+	{
+		SetHookCacheTime( LUA, rules_memo );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( SetRulesHookVariantPrefix )
+	{
+		SetHookVariantPrefix( LUA, rules_memo );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( InvalidateRulesHookCache )
+	{
+		++rules_memo.generation;
+		PublishReplySnapshot( );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( EnableInfoChallenge )
+	{
+		LUA->CheckType( 1, GarrysMod::Lua::Type::Bool );
+		info_challenge_enabled.store( LUA->GetBool( 1 ), std::memory_order_relaxed );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( EnablePlayerChallenge )
+	{
+		LUA->CheckType( 1, GarrysMod::Lua::Type::Bool );
+		player_challenge_enabled.store( LUA->GetBool( 1 ), std::memory_order_relaxed );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( SetSplitPacketSize )
+	{
+		const double size = LUA->CheckNumber( 1 );
+		if( size < 256.0 || size > 1400.0 )
+			LUA->ArgError( 1, "split size must be between 256 and 1400 bytes" );
+
+		split_packet_size = static_cast<size_t>( size );
+		// cached replies were split with the old size
+		++info_memo.generation;
+		++rules_memo.generation;
+		PublishReplySnapshot( );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( StartQueryWorkers )
+	{
+		const double port = LUA->CheckNumber( 1 );
+		const double count = LUA->CheckNumber( 2 );
+		if( port < 1.0 || port > 65535.0 )
+			LUA->ArgError( 1, "port must be between 1 and 65535" );
+
+		if( count < 1.0 || count > 32.0 )
+			LUA->ArgError( 2, "worker count must be between 1 and 32" );
+
+#if defined SYSTEM_LINUX
+
+		LUA->PushBool( StartQueryWorkerPool( static_cast<uint16_t>( port ), static_cast<size_t>( count ) ) );
+		return 1;
+
+#else
 
-	static ssize_t ReceiveAndAnalyzePacket(
-		SOCKET s,
-		void *buf,
-		recvlen_t buflen,
-		int32_t flags,
-		sockaddr *from,
-		socklen_t *fromlen
-	)
+		LUA->ThrowError( "query workers are only supported on Linux" );
+		return 0;
+
+#endif
+
+	}
+
+	LUA_FUNCTION_STATIC( StopQueryWorkers )
 	{
-		auto trampoline = recvfrom_hook.GetTrampoline<recvfrom_t>( );
-		if( trampoline == nullptr )
-			return -1;
 
-		const ssize_t len = trampoline( s, buf, buflen, flags, from, fromlen );
-		_DebugWarning( "[Query] Called recvfrom on socket %d and received %d bytes\n", s, len );
-		if( len == -1 )
-			return -1;
+#if defined SYSTEM_LINUX
 
-		const uint8_t *buffer = reinterpret_cast<uint8_t *>( buf );
+		StopQueryWorkerPool( );
 
-		const sockaddr_in &infrom = *reinterpret_cast<sockaddr_in *>( from );
+#endif
 
-		_DebugWarning( "[Query] Address %s was allowed\n", IPToString( infrom.sin_addr ) );
+		return 0;
+	}
 
-		PacketType type = ClassifyPacket( buffer, len, infrom );
-		if( type == PacketType::Info )
-			type = HandleInfoQuery( infrom );
+	LUA_FUNCTION_STATIC( EnableQueryLimiter )
+	{
+		LUA->CheckType( 1, GarrysMod::Lua::Type::Bool );
+		client_manager.SetState( LUA->GetBool( 1 ) );
+		return 0;
+	}
 
-		if( type == PacketType::Player )
-			type = HandlePlayerQuery( infrom );
+	inline void SetRateLimit( GarrysMod::Lua::ILuaBase *LUA, QueryType type )
+	{
+		const double rate = LUA->CheckNumber( 1 );
+		const double burst = LUA->CheckNumber( 2 );
+		if( rate < 0.0 || rate > 1000000.0 )
+			LUA->ArgError( 1, "rate must be between 0 (no limit) and 1000000 queries per second" );
 
-		return type != PacketType::Invalid ? len : -1;
+		if( burst < 1.0 || burst > 1000000.0 )
+			LUA->ArgError( 2, "burst must be between 1 and 1000000 queries" );
+
+		client_manager.SetRateLimit( type, rate, static_cast<uint32_t>( burst ) );
 	}
 
-	static ssize_t SERVERSECURE_CALLING_CONVENTION recvfrom_detour(
-		SOCKET s,
-		void *buf,
-		recvlen_t buflen,
-		int32_t flags,
-		sockaddr *from,
-		socklen_t *fromlen
-	)
+	LUA_FUNCTION_STATIC( SetInfoRateLimit )
 	{
-		if( s != game_socket )
+		SetRateLimit( LUA, QueryType::Info );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( SetPlayerRateLimit )
+	{
+		SetRateLimit( LUA, QueryType::Player );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( SetOtherRateLimit )
+	{
+		SetRateLimit( LUA, QueryType::Other );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( SetSubnetRateLimit )
+	{
+		const double bits = LUA->CheckNumber( 1 );
+		const double rate = LUA->CheckNumber( 2 );
+		const double burst = LUA->CheckNumber( 3 );
+		if( bits != 24.0 && bits != 16.0 )
+			LUA->ArgError( 1, "prefix length must be 24 or 16" );
+
+		if( rate < 0.0 || rate > 1000000.0 )
+			LUA->ArgError( 2, "rate must be between 0 (no limit) and 1000000 queries per second" );
+
+		if( burst < 1.0 || burst > 1000000.0 )
+			LUA->ArgError( 3, "burst must be between 1 and 1000000 queries" );
+
+		client_manager.SetSubnetRateLimit(
+			static_cast<uint32_t>( bits ),
+			rate,
+			static_cast<uint32_t>( burst )
+		);
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( SetPrefixAutoBan )
+	{
+		const double threshold = LUA->CheckNumber( 1 );
+		const double time = LUA->CheckNumber( 2 );
+		if( threshold < 0.0 || threshold > 1000000.0 )
+			LUA->ArgError( 1, "threshold must be between 0 and 1000000 rejected queries per second" );
+
+		if( time < 0.0 || time > 86400.0 )
+			LUA->ArgError( 2, "ban time must be between 0 and 86400 seconds" );
+
+		client_manager.SetAutoBan( static_cast<uint32_t>( threshold ), static_cast<uint64_t>( time * 1000000.0 ) );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( ClearPrefixBans )
+	{
+		client_manager.ClearBans( );
+		return 0;
+	}
+
+	inline void PushLatency( GarrysMod::Lua::ILuaBase *LUA, const stats_snapshot_t &stats, Stage stage )
+	{
+		const uint64_t count = stats.GetCount( stage );
+		const size_t index = static_cast<size_t>( stage );
+
+		// microseconds
+		LUA->CreateTable( );
+
+		LUA->PushNumber( static_cast<double>( count ) );
+		LUA->SetField( -2, "count" );
+
+		LUA->PushNumber( count != 0 ? stats.sums[index] / 1000.0 / static_cast<double>( count ) : 0.0 );
+		LUA->SetField( -2, "mean" );
+
+		const std::pair<const char *, double> percentiles[] = {
+			{ "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p999", 0.999 }, { "max", 1.0 }
+		};
+		for( const auto &percentile : percentiles )
 		{
-			_DebugWarning( "[Query] recvfrom detour called with socket %d, passing through\n", s );
-			auto trampoline = recvfrom_hook.GetTrampoline<recvfrom_t>( );
-			return trampoline != nullptr ? trampoline( s, buf, buflen, flags, from, fromlen ) : -1;
+			LUA->PushNumber( stats.GetPercentile( stage, percentile.second ) / 1000.0 );
+			LUA->SetField( -2, percentile.first );
 		}
 
-		//_DebugWarning( "[Query] recvfrom detour called with socket %d, detouring\n", s );
+		LUA->SetField( -2, StatsRegistry::GetName( stage ) );
+	}
 
-		packet_t p;
-		const bool has_packet = PopPacketFromQueue( p );
-		if( !has_packet )
-			return HandleNetError( -1 );
+	LUA_FUNCTION_STATIC( GetStats )
+	{
+		static stats_snapshot_t stats;
+		stats_registry.Collect( stats, true );
 
-		const ssize_t len = std::min( static_cast<ssize_t>( p.buffer.size( ) ), static_cast<ssize_t>( buflen ) );
-		p.buffer.resize( static_cast<size_t>( len ) );
-		std::copy( p.buffer.begin( ), p.buffer.end( ), static_cast<uint8_t *>( buf ) );
+		LUA->CreateTable( );
 
-		const socklen_t addrlen = std::min( *fromlen, p.address_size );
-		std::memcpy( from, &p.address, static_cast<size_t>( addrlen ) );
-		*fromlen = addrlen;
+		for( size_t k = 0; k < StatCount; ++k )
+		{
+			LUA->PushNumber( static_cast<double>( stats.counters[k] ) );
+			LUA->SetField( -2, StatsRegistry::GetName( static_cast<Stat>( k ) ) );
+		}
 
-		return len;
+		for( size_t k = 0; k < PeakCount; ++k )
+		{
+			LUA->PushNumber( static_cast<double>( stats.peaks[k] ) );
+			LUA->SetField( -2, StatsRegistry::GetName( static_cast<Peak>( k ) ) );
+		}
+
+		for( size_t k = 0; k < GaugeCount; ++k )
+		{
+			LUA->PushNumber( static_cast<double>( stats.gauges[k] ) );
+			LUA->SetField( -2, StatsRegistry::GetName( static_cast<Gauge>( k ) ) );
+		}
+
+		LUA->PushNumber( static_cast<double>( threaded_socket_max_queue - GetPacketQueueSpace( ) ) );
+		LUA->SetField( -2, "packet_queue" );
+
+		{
+			AUTO_LOCK( query_mutex );
+			LUA->PushNumber( static_cast<double>( query_queue.size( ) ) );
+		}
+		LUA->SetField( -2, "query_queue" );
+
+		LUA->CreateTable( );
+		for( size_t k = 0; k < StageCount; ++k )
+			PushLatency( LUA, stats, static_cast<Stage>( k ) );
+
+		LUA->SetField( -2, "latency" );
+		return 1;
 	}
 
-	static uintp PacketReceiverThread( void * )
+	LUA_FUNCTION_STATIC( ResetStats )
 	{
-		while( threaded_socket_execute )
+		stats_registry.Reset( );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( StartStatsExporter )
+	{
+		const char *address = LUA->CheckString( 1 );
+		const double port = LUA->CheckNumber( 2 );
+		const double interval = LUA->CheckNumber( 3 );
+		const char *prefix = LUA->IsType( 4, GarrysMod::Lua::Type::String ) ? LUA->GetString( 4 ) : "query";
+
+		in_addr addr = { };
+		if( inet_pton( AF_INET, address, &addr ) != 1 )
+			LUA->ArgError( 1, "address must be an IPv4 address" );
+
+		if( port < 1.0 || port > 65535.0 )
+			LUA->ArgError( 2, "port must be between 1 and 65535" );
+
+		if( interval < 0.1 || interval > 3600.0 )
+			LUA->ArgError( 3, "interval must be between 0.1 and 3600 seconds" );
+
+		LUA->PushBool( stats_exporter.Start(
+			ntohl( addr.s_addr ),
+			static_cast<uint16_t>( port ),
+			prefix,
+			static_cast<uint32_t>( interval * 1000.0 )
+		) );
+		return 1;
+	}
+
+	LUA_FUNCTION_STATIC( StopStatsExporter )
+	{
+		stats_exporter.Stop( );
+		return 0;
+	}
+
+	LUA_FUNCTION_STATIC( SetPacketSampling )
+	{
+		const double rate = LUA->CheckNumber( 1 );
+		if( rate < 0.0 || rate > 1000000.0 )
+			LUA->ArgError( 1, "rate must be between 0 (disabled) and 1000000" );
+
+		uint32_t mask = 0xFFFFFFFF;
+		if( LUA->IsType( 2, GarrysMod::Lua::Type::Table ) )
 		{
-			if( IsPacketQueueFull( ) )
+			mask = 0;
+			for( int32_t k = 1; ; ++k )
 			{
-				_DebugWarning( "[Query] Packet queue is full, sleeping for 100ms\n" );
-				ThreadSleep( 100 );
-				continue;
+				LUA->PushNumber( k );
+				LUA->GetTable( 2 );
+				if( !LUA->IsType( -1, GarrysMod::Lua::Type::String ) )
+				{
+					LUA->Pop( 1 );
+					break;
+				}
+
+				const char *name = LUA->GetString( -1 );
+				bool found = false;
+				for( size_t t = 0; t < sizeof( packet_type_names ) / sizeof( *packet_type_names ); ++t )
+					if( std::strcmp( name, packet_type_names[t] ) == 0 )
+					{
+						mask |= 1u << t;
+						found = true;
+					}
+
+				LUA->Pop( 1 );
+				if( !found )
+					LUA->ArgError( 2, "packet types must be invalid, good, info, player or rules" );
 			}
+		}
 
-			fd_set readables;
-			FD_ZERO( &readables );
-			FD_SET( game_socket, &readables );
-			timeval timeout = { 0, 100000 };
-			const int32_t res = select( game_socket + 1, &readables, nullptr, nullptr, &timeout );
-			if( res == -1 || !FD_ISSET( game_socket, &readables ) )
-				continue;
+		packet_sampler.Set( static_cast<uint32_t>( rate ), mask );
+		return 0;
+	}
 
-			_DebugWarning( "[Query] Select passed\n" );
+	LUA_FUNCTION_STATIC( GetSamplePackets )
+	{
+		static std::vector<packet_sample_t> samples;
+		packet_sampler.Collect( samples );
 
-			packet_t p;
-			p.buffer.resize( threaded_socket_max_buffer );
-			const ssize_t len = ReceiveAndAnalyzePacket(
-				game_socket,
-				p.buffer.data( ),
-				static_cast<recvlen_t>( threaded_socket_max_buffer ),
-				0,
-				reinterpret_cast<sockaddr *>( &p.address ),
-				&p.address_size
-			);
-			if( len == -1 )
-				continue;
+		LUA->CreateTable( );
+		for( size_t k = 0; k < samples.size( ); ++k )
+		{
+			const packet_sample_t &sample = samples[k];
+			LUA->PushNumber( static_cast<double>( k + 1 ) );
+			LUA->CreateTable( );
 
-			_DebugWarning( "[Query] Pushing packet to queue\n" );
+			LUA->PushNumber( static_cast<double>( sample.time ) / 1000000.0 );
+			LUA->SetField( -2, "time" );
+
+			in_addr address = { };
+			address.s_addr = sample.source_address;
+			LUA->PushString( IPToString( address ) );
+			LUA->SetField( -2, "ip" );
+
+			LUA->PushNumber( ntohs( sample.source_port ) );
+			LUA->SetField( -2, "port" );
+
+			LUA->PushNumber( ntohs( sample.destination_port ) );
+			LUA->SetField( -2, "local_port" );
+
+			LUA->PushString( packet_type_names[sample.type + 1] );
+			LUA->SetField( -2, "type" );
+
+			LUA->PushBool( sample.passed );
+			LUA->SetField( -2, "passed" );
+
+			LUA->PushNumber( sample.length );
+			LUA->SetField( -2, "length" );
+
+			LUA->PushString( reinterpret_cast<const char *>( sample.data ), sample.captured );
+			LUA->SetField( -2, "data" );
 
-			p.buffer.resize( static_cast<size_t>( len ) );
+			LUA->SetTable( -3 );
+		}
+
+		return 1;
+	}
+
+	LUA_FUNCTION_STATIC( ClearSamplePackets )
+	{
+		packet_sampler.Clear( );
+		return 0;
+	}
+
+	static uintp PcapDumpThread( void *param )
+	{
+		std::unique_ptr<pcap_dump_t> dump( static_cast<pcap_dump_t *>( param ) );
+
+		std::vector<uint8_t> output;
+		PacketSampler::WritePcap( dump->samples, output );
 
-			PushPacketToQueue( std::move( p ) );
+		FileHandle_t file = filesystem->Open( dump->path.c_str( ), "wb", "DATA" );
+		if( file != nullptr )
+		{
+			filesystem->Write( output.data( ), static_cast<int32_t>( output.size( ) ), file );
+			filesystem->Close( file );
+		}
+		else
+		{
+			Warning( "[Query] Unable to open %s to dump sampled packets\n", dump->path.c_str( ) );
 		}
 
+		pcap_dump_running = false;
 		return 0;
 	}
 
-	LUA_FUNCTION_STATIC( EnableInfoCache )
+	static void JoinPcapDump( )
 	{
-		LUA->CheckType( 1, GarrysMod::Lua::Type::Bool );
-		info_cache_enabled = LUA->GetBool( 1 );
+		if( pcap_dump_thread == nullptr )
+			return;
+
+		ThreadJoin( pcap_dump_thread );
+		ReleaseThreadHandle( pcap_dump_thread );
+		pcap_dump_thread = nullptr;
+	}
+
+	// no way out of the DATA search path
+	inline bool IsDataFilePath( const char *path, const char *extension )
+	{
+		const size_t len = std::strlen( path );
+		const size_t extension_len = std::strlen( extension );
+		return len > extension_len && path[0] != '/' && path[0] != '\\' &&
+			std::strstr( path, ".." ) == nullptr && std::strchr( path, ':' ) == nullptr &&
+			std::strcmp( path + len - extension_len, extension ) == 0;
+	}
+
+	LUA_FUNCTION_STATIC( DumpPcap )
+	{
+		const char *path = LUA->CheckString( 1 );
+		if( !IsDataFilePath( path, ".pcap" ) )
+			LUA->ArgError( 1, "path must be a relative path in the data folder ending with .pcap" );
+
+		if( pcap_dump_running )
+		{
+			LUA->PushBool( false );
+			return 1;
+		}
+
+		JoinPcapDump( );
+
+		// only the copy is taken here, formatting and writing happen on the dump thread
+		std::unique_ptr<pcap_dump_t> dump( new pcap_dump_t( ) );
+		dump->path = path;
+		packet_sampler.Collect( dump->samples );
+
+		pcap_dump_running = true;
+		pcap_dump_thread = CreateSimpleThread( PcapDumpThread, dump.get( ) );
+		if( pcap_dump_thread == nullptr )
+		{
+			pcap_dump_running = false;
+			LUA->PushBool( false );
+			return 1;
+		}
+
+		dump.release( );
+		LUA->PushBool( true );
+		return 1;
+	}
+
+	LUA_FUNCTION_STATIC( SetGlobalMaxQueriesPerSecond )
+	{
+		const double max = LUA->CheckNumber( 1 );
+		if( max < 0.0 || max > 1000000.0 )
+			LUA->ArgError( 1, "max must be between 0 (no limit) and 1000000 queries per second" );
+
+		client_manager.SetGlobalMaxQueriesPerSecond( max );
 		return 0;
 	}
 
@@ -982,10 +2877,14 @@ namespace netfilter
 		if( !server_loader.IsValid( ) )
 			LUA->ThrowError( "unable to get server factory" );
 
-		ICvar *icvar = InterfacePointers::Cvar( );
+		icvar = InterfacePointers::Cvar( );
 		if( icvar != nullptr )
 			sv_visiblemaxplayers = icvar->FindVar( "sv_visiblemaxplayers" );
 
+		playerinfo_manager = server_loader.GetInterface<IPlayerInfoManager>( INTERFACEVERSION_PLAYERINFOMANAGER );
+		if( playerinfo_manager == nullptr )
+			Warning( "[Query] Failed to get IPlayerInfoManager, native player replies won't have scores\n" );
+
 		gamedll = InterfacePointers::ServerGameDLL( );
 		if( gamedll == nullptr )
 			LUA->ThrowError( "failed to load required IServerGameDLL interface" );
@@ -1009,9 +2908,29 @@ namespace netfilter
 		if( game_socket == INVALID_SOCKET )
 			LUA->ThrowError( "got an invalid server socket" );
 
+		receiver.socket = game_socket;
+		receiver.stats = &stats_registry.Get( stats_receiver );
+		socklen_t receiver_address_size = sizeof( receiver.address );
+		if( getsockname(
+			game_socket,
+			reinterpret_cast<sockaddr *>( &receiver.address ),
+			&receiver_address_size
+		) != 0 )
+			receiver.address = { };
+
 		if( !recvfrom_hook.Enable( ) )
 			LUA->ThrowError( "failed to detour recvfrom" );
 
+#if defined SYSTEM_LINUX
+
+		if( !CreateReceiverEvents( ) )
+		{
+			DestroyReceiverEvents( );
+			LUA->ThrowError( "unable to create receiver thread events" );
+		}
+
+#endif
+
 		threaded_socket_execute = true;
 		threaded_socket_handle = CreateSimpleThread( PacketReceiverThread, nullptr );
 		if( threaded_socket_handle == nullptr )
@@ -1022,18 +2941,198 @@ namespace netfilter
 		LUA->PushCFunction( EnableInfoCache );
 		LUA->SetField( -2, "EnableInfoDetour" );
 
+		LUA->PushCFunction( SetInfoHookCacheTime );
+		LUA->SetField( -2, "SetInfoHookCacheTime" );
+
+		LUA->PushCFunction( SetInfoHookVariantPrefix );
+		LUA->SetField( -2, "SetInfoHookVariantPrefix" );
+
+		LUA->PushCFunction( InvalidateInfoHookCache );
+		LUA->SetField( -2, "InvalidateInfoHookCache" );
+
+		LUA->PushCFunction( EnableNativePlayerReply );
+		LUA->SetField( -2, "EnableNativePlayerReply" );
+
+		LUA->PushCFunction( SetPlayerSnapshotInterval );
+		LUA->SetField( -2, "SetPlayerSnapshotInterval" );
+
+		LUA->PushCFunction( SetPlayerOverride );
+		LUA->SetField( -2, "SetPlayerOverride" );
+
+		LUA->PushCFunction( EnableRulesDetour );
+		LUA->SetField( -2, "EnableRulesDetour" );
+
+		LUA->PushCFunction( SetRulesConVars );
+		LUA->SetField( -2, "SetRulesConVars" );
+
+		LUA->PushCFunction( SetRulesHookCacheTime );
+		LUA->SetField( -2, "SetRulesHookCacheTime" );
+
+		LUA->PushCFunction( SetRulesHookVariantPrefix );
+		LUA->SetField( -2, "SetRulesHookVariantPrefix" );
+
+		LUA->PushCFunction( InvalidateRulesHookCache );
+		LUA->SetField( -2, "InvalidateRulesHookCache" );
+
+		LUA->PushCFunction( EnableInfoChallenge );
+		LUA->SetField( -2, "EnableInfoChallenge" );
+
+		LUA->PushCFunction( EnablePlayerChallenge );
+		LUA->SetField( -2, "EnablePlayerChallenge" );
+
+		LUA->PushCFunction( SetSplitPacketSize );
+		LUA->SetField( -2, "SetSplitPacketSize" );
+
+		LUA->PushCFunction( StartQueryWorkers );
+		LUA->SetField( -2, "StartQueryWorkers" );
+
+		LUA->PushCFunction( StopQueryWorkers );
+		LUA->SetField( -2, "StopQueryWorkers" );
+
+		LUA->PushCFunction( EnableQueryLimiter );
+		LUA->SetField( -2, "EnableQueryLimiter" );
+
+		LUA->PushCFunction( SetInfoRateLimit );
+		LUA->SetField( -2, "SetInfoRateLimit" );
+
+		LUA->PushCFunction( SetPlayerRateLimit );
+		LUA->SetField( -2, "SetPlayerRateLimit" );
+
+		LUA->PushCFunction( SetOtherRateLimit );
+		LUA->SetField( -2, "SetOtherRateLimit" );
+
+		LUA->PushCFunction( SetGlobalMaxQueriesPerSecond );
+		LUA->SetField( -2, "SetGlobalMaxQueriesPerSecond" );
+
+		LUA->PushCFunction( SetSubnetRateLimit );
+		LUA->SetField( -2, "SetSubnetRateLimit" );
+
+		LUA->PushCFunction( SetPrefixAutoBan );
+		LUA->SetField( -2, "SetPrefixAutoBan" );
+
+		LUA->PushCFunction( ClearPrefixBans );
+		LUA->SetField( -2, "ClearPrefixBans" );
+
+		LUA->PushCFunction( GetStats );
+		LUA->SetField( -2, "GetStats" );
+
+		LUA->PushCFunction( ResetStats );
+		LUA->SetField( -2, "ResetStats" );
+
+		LUA->PushCFunction( StartStatsExporter );
+		LUA->SetField( -2, "StartStatsExporter" );
+
+		LUA->PushCFunction( StopStatsExporter );
+		LUA->SetField( -2, "StopStatsExporter" );
+
+		LUA->PushCFunction( SetPacketSampling );
+		LUA->SetField( -2, "SetPacketSampling" );
+
+		LUA->PushCFunction( GetSamplePackets );
+		LUA->SetField( -2, "GetSamplePackets" );
+
+		LUA->PushCFunction( ClearSamplePackets );
+		LUA->SetField( -2, "ClearSamplePackets" );
+
+		LUA->PushCFunction( DumpPcap );
+		LUA->SetField( -2, "DumpPcap" );
+
+		// game events only reach hooks once something listens to them
+		LUA->GetField( GarrysMod::Lua::INDEX_GLOBAL, "gameevent" );
+		if( LUA->IsType( -1, GarrysMod::Lua::Type::Table ) )
+			for( const char *event : info_dirty_events )
+			{
+				LUA->GetField( -1, "Listen" );
+				LUA->PushString( event );
+				LUA->Call( 1, 0 );
+			}
+
+		LUA->Pop( 1 );
+
+		LUA->GetField( GarrysMod::Lua::INDEX_GLOBAL, "hook" );
+		if( !LUA->IsType( -1, GarrysMod::Lua::Type::Table ) )
+			LUA->ThrowError( "missing hook table" );
+
+		LUA->GetField( -1, "Add" );
+		LUA->PushString( "Think" );
+		LUA->PushString( query_think_hook );
+		LUA->PushCFunction( ProcessQueries );
+		LUA->Call( 3, 0 );
+
+		for( const char *event : info_dirty_events )
+		{
+			LUA->GetField( -1, "Add" );
+			LUA->PushString( event );
+			LUA->PushString( query_think_hook );
+			LUA->PushCFunction( MarkInfoDirty );
+			LUA->Call( 3, 0 );
+		}
+
+		LUA->Pop( 1 );
 	}
 
-	void Deinitialize( GarrysMod::Lua::ILuaBase * )
+	void Deinitialize( GarrysMod::Lua::ILuaBase *LUA )
 	{
+		if( player_override_ref != -1 )
+		{
+			LUA->ReferenceFree( player_override_ref );
+			player_override_ref = -1;
+		}
+
+		player_snapshot.reset( );
+		info_cache_payload.reset( );
+
+		LUA->GetField( GarrysMod::Lua::INDEX_GLOBAL, "hook" );
+		if( LUA->IsType( -1, GarrysMod::Lua::Type::Table ) )
+		{
+			LUA->GetField( -1, "Remove" );
+			LUA->PushString( "Think" );
+			LUA->PushString( query_think_hook );
+			LUA->Call( 2, 0 );
+
+			for( const char *event : info_dirty_events )
+			{
+				LUA->GetField( -1, "Remove" );
+				LUA->PushString( event );
+				LUA->PushString( query_think_hook );
+				LUA->Call( 2, 0 );
+			}
+		}
+
+		LUA->Pop( 1 );
+
+		stats_exporter.Stop( );
+		JoinPcapDump( );
+
+#if defined SYSTEM_LINUX
+
+		StopQueryWorkerPool( );
+
+#endif
+
 		if( threaded_socket_handle != nullptr )
 		{
 			threaded_socket_execute = false;
+
+#if defined SYSTEM_LINUX
+
+			SignalEvent( threaded_socket_shutdown_event );
+
+#endif
+
 			ThreadJoin( threaded_socket_handle );
 			ReleaseThreadHandle( threaded_socket_handle );
 			threaded_socket_handle = nullptr;
 		}
 
+#if defined SYSTEM_LINUX
+
+		DestroyReceiverEvents( );
+
+#endif
+
+		reply_snapshot.Publish( nullptr );
+
 		recvfrom_hook.Destroy( );
 	}
 }
@@ -0,0 +1,228 @@
+#include "exporter.hpp"
+
+#include <Platform.hpp>
+#include <dbg.h>
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+
+#if defined SYSTEM_WINDOWS
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+
+#include <WinSock2.h>
+#include <Ws2tcpip.h>
+
+typedef SOCKET socket_t;
+
+#elif defined SYSTEM_POSIX
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+typedef int32_t socket_t;
+
+static const socket_t INVALID_SOCKET = -1;
+
+#define closesocket close
+
+#endif
+
+namespace netfilter
+{
+	static const uint32_t exporter_sleep_step = 50; // milliseconds
+
+	static const std::pair<const char *, double> exporter_percentiles[] = {
+		{ "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "max", 1.0 }
+	};
+
+	StatsExporter::StatsExporter( StatsRegistry &registry ) :
+		registry( registry ),
+		thread( nullptr ),
+		running( false ),
+		address( 0 ),
+		port( 0 ),
+		interval( 0 ),
+		last( new stats_snapshot_t( ) ),
+		totals( new stats_snapshot_t( ) ),
+		delta( new stats_snapshot_t( ) )
+	{ }
+
+	StatsExporter::~StatsExporter( )
+	{
+		Stop( );
+	}
+
+	bool StatsExporter::Start( uint32_t address, uint16_t port, const std::string &prefix, uint32_t interval )
+	{
+		Stop( );
+
+		this->address = address;
+		this->port = port;
+		this->prefix = prefix;
+		this->interval = interval;
+
+		// the first push only reports what happened after starting
+		registry.Collect( *last, false );
+		registry.CollectExportPeaks( last->peaks );
+
+		running = true;
+		thread = CreateSimpleThread( Thread, this );
+		if( thread == nullptr )
+		{
+			running = false;
+			return false;
+		}
+
+		return true;
+	}
+
+	void StatsExporter::Stop( )
+	{
+		running = false;
+		if( thread == nullptr )
+			return;
+
+		ThreadJoin( thread );
+		ReleaseThreadHandle( thread );
+		thread = nullptr;
+	}
+
+	bool StatsExporter::IsRunning( ) const
+	{
+		return running;
+	}
+
+	uintp StatsExporter::Thread( void *param )
+	{
+		static_cast<StatsExporter *>( param )->Run( );
+		return 0;
+	}
+
+	void StatsExporter::Run( )
+	{
+		const socket_t s = socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP );
+		if( s == INVALID_SOCKET )
+		{
+			Warning( "[Query] Unable to create the stats exporter socket\n" );
+			running = false;
+			return;
+		}
+
+		sockaddr_in to = { };
+		to.sin_family = AF_INET;
+		to.sin_addr.s_addr = htonl( address );
+		to.sin_port = htons( port );
+
+		std::string lines;
+		while( running )
+		{
+			for( uint32_t slept = 0; running && slept < interval; slept += exporter_sleep_step )
+				ThreadSleep( exporter_sleep_step );
+
+			if( !running )
+				break;
+
+			lines.clear( );
+			Export( lines );
+
+			// as many whole lines per datagram as fit, every line ends with '\n'
+			size_t start = 0;
+			while( start < lines.size( ) )
+			{
+				size_t end = lines.find( '\n', start ) + 1;
+				for( size_t next = lines.find( '\n', end );
+					next != std::string::npos && next - start <= MaxDatagram;
+					next = lines.find( '\n', end ) )
+					end = next + 1;
+
+				sendto(
+					s,
+					lines.data( ) + start,
+					static_cast<int32_t>( end - start - 1 ), // without the last line end
+					0,
+					reinterpret_cast<const sockaddr *>( &to ),
+					sizeof( to )
+				);
+				start = end;
+			}
+		}
+
+		closesocket( s );
+	}
+
+	void StatsExporter::Export( std::string &lines )
+	{
+		registry.Collect( *totals, false );
+		*delta = *totals;
+		delta->Subtract( *last );
+		// Collect's peaks go back to the last ResetStats from Lua
+		registry.CollectExportPeaks( delta->peaks );
+		std::swap( last, totals );
+
+		for( size_t k = 0; k < StatCount; ++k )
+			Append(
+				lines,
+				"%s.%s:%llu|c",
+				prefix.c_str( ),
+				StatsRegistry::GetName( static_cast<Stat>( k ) ),
+				static_cast<unsigned long long>( delta->counters[k] )
+			);
+
+		for( size_t k = 0; k < PeakCount; ++k )
+			Append(
+				lines,
+				"%s.%s:%llu|g",
+				prefix.c_str( ),
+				StatsRegistry::GetName( static_cast<Peak>( k ) ),
+				static_cast<unsigned long long>( delta->peaks[k] )
+			);
+
+		for( size_t k = 0; k < GaugeCount; ++k )
+			Append(
+				lines,
+				"%s.%s:%llu|g",
+				prefix.c_str( ),
+				StatsRegistry::GetName( static_cast<Gauge>( k ) ),
+				static_cast<unsigned long long>( delta->gauges[k] )
+			);
+
+		// microseconds, stages without samples in this interval are left out
+		for( size_t k = 0; k < StageCount; ++k )
+		{
+			const Stage stage = static_cast<Stage>( k );
+			if( delta->GetCount( stage ) == 0 )
+				continue;
+
+			for( const auto &percentile : exporter_percentiles )
+				Append(
+					lines,
+					"%s.latency.%s.%s:%.3f|g",
+					prefix.c_str( ),
+					StatsRegistry::GetName( stage ),
+					percentile.first,
+					delta->GetPercentile( stage, percentile.second ) / 1000.0
+				);
+		}
+	}
+
+	void StatsExporter::Append( std::string &lines, const char *format, ... )
+	{
+		char line[256];
+		va_list args;
+		va_start( args, format );
+		const int32_t len = vsnprintf( line, sizeof( line ), format, args );
+		va_end( args );
+		if( len <= 0 || static_cast<size_t>( len ) >= sizeof( line ) )
+			return;
+
+		lines.append( line, static_cast<size_t>( len ) );
+		lines.push_back( '\n' );
+	}
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "stats.hpp"
+
+#include <threadtools.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace netfilter
+{
+	// pushes the stats as StatsD lines over UDP from its own thread, counters are sent as
+	// deltas since the previous push, latencies as percentiles and queue peaks as the
+	// highest depths of that interval
+	class StatsExporter
+	{
+	public:
+		StatsExporter( StatsRegistry &registry );
+		~StatsExporter( );
+
+		// address and port in host byte order, interval in milliseconds
+		bool Start( uint32_t address, uint16_t port, const std::string &prefix, uint32_t interval );
+		void Stop( );
+
+		bool IsRunning( ) const;
+
+	private:
+		static uintp Thread( void *param );
+
+		void Run( );
+		// newline separated StatsD lines for the last interval
+		void Export( std::string &lines );
+		void Append( std::string &lines, const char *format, ... );
+
+		static const size_t MaxDatagram = 1400;
+
+		StatsRegistry &registry;
+		ThreadHandle_t thread;
+		std::atomic_bool running;
+		uint32_t address;
+		uint16_t port;
+		std::string prefix;
+		uint32_t interval;
+		std::unique_ptr<stats_snapshot_t> last;
+		std::unique_ptr<stats_snapshot_t> totals;
+		std::unique_ptr<stats_snapshot_t> delta;
+	};
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include "challenge.hpp"
+#include "clientmanager.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+namespace netfilter
+{
+	// what the first bytes of a packet on the game socket say it is
+	enum class PacketHeader
+	{
+		Malformed,
+		Connected, // netchannel traffic of players already in the server
+		Info,
+		Player,
+		Rules,
+		Other // any other connectionless packet
+	};
+
+	inline PacketHeader ParsePacketHeader( const uint8_t *data, int32_t len )
+	{
+		if( len == 0 )
+			return PacketHeader::Malformed;
+
+		if( len < 5 )
+			return PacketHeader::Connected;
+
+		int32_t channel = 0;
+		std::memcpy( &channel, data, sizeof( channel ) );
+		if( channel == -2 )
+			return PacketHeader::Malformed;
+
+		if( channel != -1 )
+			return PacketHeader::Connected;
+
+		switch( data[4] )
+		{
+		case 'T':
+			return PacketHeader::Info;
+
+		case 'U':
+			return PacketHeader::Player;
+
+		case 'V':
+			return PacketHeader::Rules;
+
+		default:
+			return PacketHeader::Other;
+		}
+	}
+
+	// banned addresses only lose connectionless packets, players already in the server keep
+	// their connection, address in host byte order
+	inline bool IsBannedPacket( const ClientManager &manager, PacketHeader header, uint32_t address, uint64_t time )
+	{
+		return header != PacketHeader::Malformed && header != PacketHeader::Connected &&
+			manager.IsBanned( address, time );
+	}
+
+	// which queries the module answers instead of the engine and which of those need one of
+	// our challenges first, defaults match a freshly loaded module on the game port
+	struct query_policy_t
+	{
+		bool info_answered = false; // EnableInfoDetour or the query port
+		bool rules_answered = false; // EnableRulesDetour or the query port
+		bool info_challenge = false;
+		bool player_challenge = true;
+	};
+
+	// A2S_PLAYER is always answered, by the native reply if nothing else
+	inline bool IsAnsweredQuery( PacketHeader header, const query_policy_t &policy )
+	{
+		switch( header )
+		{
+		case PacketHeader::Info:
+			return policy.info_answered;
+
+		case PacketHeader::Player:
+			return true;
+
+		case PacketHeader::Rules:
+			return policy.rules_answered;
+
+		default:
+			return false;
+		}
+	}
+
+	// every connectionless packet goes through the limiter, answered or not
+	inline QueryType GetQueryType( PacketHeader header )
+	{
+		switch( header )
+		{
+		case PacketHeader::Info:
+			return QueryType::Info;
+
+		case PacketHeader::Player:
+			return QueryType::Player;
+
+		default:
+			return QueryType::Other;
+		}
+	}
+
+	// A2S_INFO challenges (2020 protocol update) go after "Source Engine Query\0"
+	static constexpr int32_t info_challenge_offset = 25;
+	static constexpr int32_t player_challenge_offset = 5;
+	static constexpr int32_t rules_challenge_offset = 5;
+
+	// where the challenge of a query we answer is, -1 when it doesn't need one, queries the
+	// engine answers carry the engine's challenges
+	inline int32_t GetChallengeOffset( PacketHeader header, const query_policy_t &policy )
+	{
+		switch( header )
+		{
+		case PacketHeader::Info:
+			return policy.info_answered && policy.info_challenge ? info_challenge_offset : -1;
+
+		case PacketHeader::Player:
+			return policy.player_challenge ? player_challenge_offset : -1;
+
+		case PacketHeader::Rules:
+			// A2S_RULES always requires a challenge
+			return policy.rules_answered ? rules_challenge_offset : -1;
+
+		default:
+			return -1;
+		}
+	}
+
+	enum class ChallengeStatus
+	{
+		Missing,
+		Valid,
+		Invalid
+	};
+
+	// only a valid challenge lets a query through, anything else gets a fresh one back,
+	// address in network byte order
+	inline ChallengeStatus CheckQueryChallenge(
+		const ChallengeManager &manager,
+		const uint8_t *data,
+		int32_t len,
+		int32_t offset,
+		uint32_t address,
+		uint64_t time
+	)
+	{
+		if( len < offset + 4 )
+			return ChallengeStatus::Missing;
+
+		uint32_t challenge = 0;
+		std::memcpy( &challenge, data + offset, sizeof( challenge ) );
+		if( challenge == 0xFFFFFFFF )
+			return ChallengeStatus::Missing;
+
+		return manager.CheckChallenge( address, challenge, time ) ?
+			ChallengeStatus::Valid : ChallengeStatus::Invalid;
+	}
+}
@@ -0,0 +1,182 @@
+#include "sampler.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace netfilter
+{
+	static const uint32_t pcap_magic = 0xA1B2C3D4; // microsecond timestamps
+	static const uint32_t pcap_linktype_raw = 101;
+	static const size_t ipv4_header_size = 20;
+	static const size_t udp_header_size = 8;
+
+	PacketSampler::PacketSampler( ) :
+		rate( 0 ), mask( 0 ), head( 0 ), slots( new slot_t[Capacity] )
+	{
+		for( size_t k = 0; k < Capacity; ++k )
+			slots[k].sequence.store( 0, std::memory_order_relaxed );
+	}
+
+	void PacketSampler::Set( uint32_t rate, uint32_t mask )
+	{
+		this->mask.store( mask, std::memory_order_relaxed );
+		this->rate.store( rate, std::memory_order_relaxed );
+	}
+
+	uint32_t PacketSampler::GetRate( ) const
+	{
+		return rate.load( std::memory_order_relaxed );
+	}
+
+	bool PacketSampler::ShouldSample( uint32_t &countdown, uint32_t type_bit ) const
+	{
+		const uint32_t every = rate.load( std::memory_order_relaxed );
+		if( every == 0 || ( mask.load( std::memory_order_relaxed ) & type_bit ) == 0 )
+			return false;
+
+		if( countdown > 1 && countdown <= every )
+		{
+			--countdown;
+			return false;
+		}
+
+		countdown = every;
+		return true;
+	}
+
+	void PacketSampler::Add( const packet_sample_t &header, const uint8_t *data, size_t len )
+	{
+		const uint64_t ticket = head.fetch_add( 1, std::memory_order_relaxed );
+		slot_t &slot = slots[ticket % Capacity];
+
+		uint64_t sequence = slot.sequence.load( std::memory_order_relaxed );
+		if( ( sequence & 1 ) != 0 ||
+			!slot.sequence.compare_exchange_strong( sequence, sequence | 1, std::memory_order_relaxed ) )
+			return;
+
+		std::atomic_thread_fence( std::memory_order_release );
+
+		packet_sample_t &sample = slot.sample;
+		std::memcpy( &sample, &header, offsetof( packet_sample_t, data ) );
+		sample.length = static_cast<uint32_t>( len );
+		sample.captured = static_cast<uint32_t>( std::min( len, SnapLength ) );
+		std::memcpy( sample.data, data, sample.captured );
+
+		slot.sequence.store( ( ticket + 1 ) * 2, std::memory_order_release );
+	}
+
+	void PacketSampler::Collect( std::vector<packet_sample_t> &samples ) const
+	{
+		std::vector<std::pair<uint64_t, size_t>> order;
+		order.reserve( Capacity );
+		samples.clear( );
+		samples.reserve( Capacity );
+		for( size_t k = 0; k < Capacity; ++k )
+		{
+			const slot_t &slot = slots[k];
+			const uint64_t sequence = slot.sequence.load( std::memory_order_acquire );
+			if( sequence == 0 || ( sequence & 1 ) != 0 )
+				continue;
+
+			samples.emplace_back( );
+			packet_sample_t &sample = samples.back( );
+			std::memcpy( &sample, &slot.sample, offsetof( packet_sample_t, data ) );
+			std::memcpy( sample.data, slot.sample.data, std::min<size_t>( sample.captured, SnapLength ) );
+
+			std::atomic_thread_fence( std::memory_order_acquire );
+			if( slot.sequence.load( std::memory_order_relaxed ) != sequence )
+			{
+				samples.pop_back( ); // overwritten while copying
+				continue;
+			}
+
+			order.emplace_back( sequence, samples.size( ) - 1 );
+		}
+
+		std::sort( order.begin( ), order.end( ) );
+
+		std::vector<packet_sample_t> sorted;
+		sorted.reserve( order.size( ) );
+		for( const auto &entry : order )
+			sorted.emplace_back( samples[entry.second] );
+
+		samples.swap( sorted );
+	}
+
+	void PacketSampler::Clear( )
+	{
+		for( size_t k = 0; k < Capacity; ++k )
+		{
+			uint64_t sequence = slots[k].sequence.load( std::memory_order_relaxed );
+			if( ( sequence & 1 ) == 0 )
+				slots[k].sequence.compare_exchange_strong( sequence, 0, std::memory_order_relaxed );
+		}
+	}
+
+	template<typename T>
+	inline void WriteNative( std::vector<uint8_t> &output, T value )
+	{
+		const uint8_t *bytes = reinterpret_cast<const uint8_t *>( &value );
+		output.insert( output.end( ), bytes, bytes + sizeof( value ) );
+	}
+
+	inline void WriteBigEndian16( uint8_t *output, uint16_t value )
+	{
+		output[0] = static_cast<uint8_t>( value >> 8 );
+		output[1] = static_cast<uint8_t>( value );
+	}
+
+	void PacketSampler::WritePcap( const std::vector<packet_sample_t> &samples, std::vector<uint8_t> &output )
+	{
+		output.clear( );
+		output.reserve( 24 + samples.size( ) * ( 16 + ipv4_header_size + udp_header_size + 128 ) );
+
+		WriteNative<uint32_t>( output, pcap_magic );
+		WriteNative<uint16_t>( output, 2 );
+		WriteNative<uint16_t>( output, 4 );
+		WriteNative<int32_t>( output, 0 ); // GMT
+		WriteNative<uint32_t>( output, 0 );
+		WriteNative<uint32_t>( output, static_cast<uint32_t>( ipv4_header_size + udp_header_size + SnapLength ) );
+		WriteNative<uint32_t>( output, pcap_linktype_raw );
+
+		for( const packet_sample_t &sample : samples )
+		{
+			const size_t headers = ipv4_header_size + udp_header_size;
+			const uint32_t length = static_cast<uint32_t>( std::min<size_t>( headers + sample.length, 65535 ) );
+			WriteNative<uint32_t>( output, static_cast<uint32_t>( sample.time / 1000000 ) );
+			WriteNative<uint32_t>( output, static_cast<uint32_t>( sample.time % 1000000 ) );
+			WriteNative<uint32_t>( output, static_cast<uint32_t>( headers + sample.captured ) );
+			WriteNative<uint32_t>( output, length );
+
+			uint8_t ip[ipv4_header_size] = {
+				0x45, 0, // IPv4, 20 bytes of header
+				0, 0, // total length
+				0, 0, 0x40, 0, // don't fragment
+				64, 17, // TTL, UDP
+				0, 0 // checksum
+			};
+			WriteBigEndian16( ip + 2, static_cast<uint16_t>( length ) );
+			std::memcpy( ip + 12, &sample.source_address, 4 );
+			std::memcpy( ip + 16, &sample.destination_address, 4 );
+
+			uint32_t checksum = 0;
+			for( size_t k = 0; k < ipv4_header_size; k += 2 )
+				checksum += static_cast<uint32_t>( ip[k] << 8 | ip[k + 1] );
+
+			while( checksum > 0xFFFF )
+				checksum = ( checksum & 0xFFFF ) + ( checksum >> 16 );
+
+			WriteBigEndian16( ip + 10, static_cast<uint16_t>( ~checksum ) );
+			output.insert( output.end( ), ip, ip + sizeof( ip ) );
+
+			// no UDP checksum, it's optional over IPv4
+			uint8_t udp[udp_header_size] = { };
+			std::memcpy( udp, &sample.source_port, 2 );
+			std::memcpy( udp + 2, &sample.destination_port, 2 );
+			WriteBigEndian16( udp + 4, static_cast<uint16_t>( length - ipv4_header_size ) );
+			output.insert( output.end( ), udp, udp + sizeof( udp ) );
+
+			output.insert( output.end( ), sample.data, sample.data + sample.captured );
+		}
+	}
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace netfilter
+{
+	struct packet_sample_t
+	{
+		uint64_t time; // microseconds since the unix epoch
+		uint32_t source_address; // network byte order like the ports
+		uint16_t source_port;
+		uint32_t destination_address;
+		uint16_t destination_port;
+		int32_t type; // whatever the caller classified it as
+		bool passed;
+		uint32_t length; // as received
+		uint32_t captured;
+		uint8_t data[1500];
+	};
+
+	// keeps the latest sampled packets in a preallocated ring shared by every receiving
+	// thread, writers claim slots with a ticket and readers copy them like a seqlock so
+	// sampling never blocks, a slot still being written when its turn comes again is
+	// skipped instead
+	class PacketSampler
+	{
+	public:
+		PacketSampler( );
+
+		// 1 in rate packets whose type bit is set in mask, rate 0 disables sampling
+		void Set( uint32_t rate, uint32_t mask );
+		uint32_t GetRate( ) const;
+
+		// countdown belongs to the calling thread
+		bool ShouldSample( uint32_t &countdown, uint32_t type_bit ) const;
+		void Add( const packet_sample_t &header, const uint8_t *data, size_t len );
+
+		// oldest first
+		void Collect( std::vector<packet_sample_t> &samples ) const;
+		void Clear( );
+
+		// pcap file with raw IPv4 link type, IPv4 and UDP headers are made up from the
+		// sample addresses
+		static void WritePcap( const std::vector<packet_sample_t> &samples, std::vector<uint8_t> &output );
+
+		static const size_t Capacity = 256;
+		static const size_t SnapLength = sizeof( packet_sample_t::data );
+
+	private:
+		struct alignas( 64 ) slot_t
+		{
+			// odd while written, ( ticket + 1 ) * 2 once done and 0 when empty
+			std::atomic<uint64_t> sequence;
+			packet_sample_t sample;
+		};
+
+		std::atomic<uint32_t> rate;
+		std::atomic<uint32_t> mask;
+		alignas( 64 ) std::atomic<uint64_t> head;
+		std::unique_ptr<slot_t[]> slots;
+	};
+}
@@ -0,0 +1,275 @@
+#include "serializer.hpp"
+
+#include <bitbuf.h>
+
+#include <cstdlib>
+
+namespace netfilter
+{
+	static constexpr uint8_t protocol_version = 17;
+	static constexpr int32_t player_count_offset = 5;
+	static constexpr size_t max_players = 255;
+
+	// 0x80 - port number is present
+	// 0x10 - server steamid is present
+	// 0x20 - tags are present
+	// 0x01 - game long appid is present
+	static inline uint8_t GetExtraDataFlags( bool has_tags )
+	{
+		return 0x80 | 0x10 | ( has_tags ? 0x20 : 0x00 ) | 0x01;
+	}
+
+	static inline int32_t GetAbsoluteIndex( GarrysMod::Lua::ILuaBase *LUA, int32_t index )
+	{
+		return index < 0 ? LUA->Top( ) + index + 1 : index;
+	}
+
+	static void WriteStringField(
+		bf_write &packet,
+		GarrysMod::Lua::ILuaBase *LUA,
+		int32_t index,
+		const char *field,
+		const std::string &def
+	)
+	{
+		LUA->GetField( index, field );
+		if( LUA->IsType( -1, GarrysMod::Lua::Type::String ) )
+			packet.WriteString( LUA->GetString( -1 ) );
+		else
+			packet.WriteString( def.c_str( ) );
+
+		LUA->Pop( 1 );
+	}
+
+	static double GetNumberField(
+		GarrysMod::Lua::ILuaBase *LUA,
+		int32_t index,
+		const char *field,
+		double def
+	)
+	{
+		LUA->GetField( index, field );
+		const double value = LUA->IsType( -1, GarrysMod::Lua::Type::Number ) ? LUA->GetNumber( -1 ) : def;
+		LUA->Pop( 1 );
+		return value;
+	}
+
+	static bool GetBoolField(
+		GarrysMod::Lua::ILuaBase *LUA,
+		int32_t index,
+		const char *field,
+		bool def
+	)
+	{
+		LUA->GetField( index, field );
+		const bool value = LUA->IsType( -1, GarrysMod::Lua::Type::Bool ) ? LUA->GetBool( -1 ) : def;
+		LUA->Pop( 1 );
+		return value;
+	}
+
+	static char GetCharField(
+		GarrysMod::Lua::ILuaBase *LUA,
+		int32_t index,
+		const char *field,
+		char def
+	)
+	{
+		LUA->GetField( index, field );
+		char value = def;
+		if( LUA->IsType( -1, GarrysMod::Lua::Type::String ) )
+			value = LUA->GetString( -1 )[0];
+
+		LUA->Pop( 1 );
+		return value;
+	}
+
+	static uint64_t GetSteamIDField(
+		GarrysMod::Lua::ILuaBase *LUA,
+		int32_t index,
+		uint64_t def
+	)
+	{
+		LUA->GetField( index, "steamid" );
+		uint64_t value = def;
+		if( LUA->IsType( -1, GarrysMod::Lua::Type::String ) )
+			value = std::strtoull( LUA->GetString( -1 ), nullptr, 10 );
+		else if( LUA->IsType( -1, GarrysMod::Lua::Type::Number ) )
+			value = static_cast<uint64_t>( LUA->GetNumber( -1 ) );
+
+		LUA->Pop( 1 );
+		return value;
+	}
+
+	void WriteInfoReply( bf_write &packet, const reply_info_t &info, info_offsets_t *offsets )
+	{
+		const bool has_tags = !info.tags.empty( );
+
+		packet.Reset( );
+
+		packet.WriteLong( -1 ); // connectionless packet header
+		packet.WriteByte( 'I' ); // packet type is always 'I'
+		packet.WriteByte( protocol_version );
+		packet.WriteString( info.game_name.c_str( ) );
+		packet.WriteString( info.map_name.c_str( ) );
+		packet.WriteString( info.game_dir.c_str( ) );
+		packet.WriteString( info.gamemode_name.c_str( ) );
+		packet.WriteShort( info.appid );
+
+		if( offsets != nullptr )
+		{
+			const int32_t offset = packet.GetNumBytesWritten( );
+			offsets->amt_clients = offset;
+			offsets->max_clients = offset + 1;
+			offsets->amt_bots = offset + 2;
+			offsets->secure = offset + 6;
+		}
+
+		packet.WriteByte( info.amt_clients );
+		packet.WriteByte( info.max_clients );
+		packet.WriteByte( info.amt_bots );
+		packet.WriteByte( info.server_type );
+		packet.WriteByte( info.os_type );
+		packet.WriteByte( info.passworded ? 1 : 0 );
+		// if vac protected, it activates itself some time after startup
+		packet.WriteByte( info.secure ? 1 : 0 );
+		packet.WriteString( info.game_version.c_str( ) );
+		packet.WriteByte( GetExtraDataFlags( has_tags ) );
+		packet.WriteShort( info.udp_port );
+		packet.WriteLongLong( info.steamid );
+		if( has_tags )
+			packet.WriteString( info.tags.c_str( ) );
+		packet.WriteLongLong( info.appid );
+	}
+
+	void PatchInfoReply( bf_write &packet, const info_offsets_t &offsets, const reply_info_t &info )
+	{
+		uint8_t *data = packet.GetData( );
+		data[offsets.amt_clients] = static_cast<uint8_t>( info.amt_clients );
+		data[offsets.max_clients] = static_cast<uint8_t>( info.max_clients );
+		data[offsets.amt_bots] = static_cast<uint8_t>( info.amt_bots );
+		data[offsets.secure] = info.secure ? 1 : 0;
+	}
+
+	void WriteInfoReply(
+		bf_write &packet,
+		GarrysMod::Lua::ILuaBase *LUA,
+		int32_t index,
+		const reply_info_t &defaults
+	)
+	{
+		index = GetAbsoluteIndex( LUA, index );
+
+		packet.Reset( );
+
+		packet.WriteLong( -1 ); // connectionless packet header
+		packet.WriteByte( 'I' ); // packet type is always 'I'
+		packet.WriteByte( protocol_version );
+		WriteStringField( packet, LUA, index, "name", defaults.game_name );
+		WriteStringField( packet, LUA, index, "map", defaults.map_name );
+		WriteStringField( packet, LUA, index, "folder", defaults.game_dir );
+		WriteStringField( packet, LUA, index, "gamemode", defaults.gamemode_name );
+		packet.WriteShort( defaults.appid );
+		packet.WriteByte( static_cast<int32_t>( GetNumberField( LUA, index, "players", defaults.amt_clients ) ) );
+		packet.WriteByte( static_cast<int32_t>( GetNumberField( LUA, index, "maxplayers", defaults.max_clients ) ) );
+		packet.WriteByte( static_cast<int32_t>( GetNumberField( LUA, index, "bots", defaults.amt_bots ) ) );
+		packet.WriteByte( GetCharField( LUA, index, "servertype", defaults.server_type ) );
+		packet.WriteByte( GetCharField( LUA, index, "os", defaults.os_type ) );
+		packet.WriteByte( GetBoolField( LUA, index, "passworded", defaults.passworded ) ? 1 : 0 );
+		packet.WriteByte( GetBoolField( LUA, index, "VAC", defaults.secure ) ? 1 : 0 );
+		packet.WriteString( defaults.game_version.c_str( ) );
+
+		// the tags stay on the stack until they're written after the flags that announce them
+		LUA->GetField( index, "tags" );
+		const char *tags = LUA->IsType( -1, GarrysMod::Lua::Type::String ) ?
+			LUA->GetString( -1 ) : defaults.tags.c_str( );
+		const bool has_tags = tags[0] != '\0';
+
+		packet.WriteByte( GetExtraDataFlags( has_tags ) );
+		packet.WriteShort( static_cast<int32_t>( GetNumberField( LUA, index, "gameport", defaults.udp_port ) ) );
+		packet.WriteLongLong( GetSteamIDField( LUA, index, defaults.steamid ) );
+		if( has_tags )
+			packet.WriteString( tags );
+		packet.WriteLongLong( defaults.appid );
+
+		LUA->Pop( 1 );
+	}
+
+	void WritePlayerReplyHeader( bf_write &packet )
+	{
+		packet.Reset( );
+
+		packet.WriteLong( -1 ); // connectionless packet header
+		packet.WriteByte( 'D' ); // packet type is always 'D'
+		packet.WriteByte( 0 ); // player count, patched by WritePlayerReplyCount
+	}
+
+	void WritePlayerReplyEntry(
+		bf_write &packet,
+		uint8_t index,
+		const char *name,
+		double score,
+		double time
+	)
+	{
+		packet.WriteByte( index );
+		packet.WriteString( name );
+		packet.WriteLong( static_cast<int32_t>( score ) );
+		packet.WriteFloat( static_cast<float>( time ) );
+	}
+
+	void WritePlayerReplyCount( bf_write &packet, uint8_t count )
+	{
+		packet.GetData( )[player_count_offset] = count;
+	}
+
+	void WritePlayerReply( bf_write &packet, GarrysMod::Lua::ILuaBase *LUA, int32_t index )
+	{
+		index = GetAbsoluteIndex( LUA, index );
+
+		WritePlayerReplyHeader( packet );
+
+		size_t count = static_cast<size_t>( LUA->ObjLen( index ) );
+		if( count > max_players )
+			count = max_players;
+
+		uint8_t written = 0;
+		for( size_t k = 0; k < count; ++k )
+		{
+			LUA->PushNumber( static_cast<double>( k + 1 ) );
+			LUA->GetTable( index );
+			if( LUA->IsType( -1, GarrysMod::Lua::Type::Table ) )
+			{
+				LUA->GetField( -1, "name" );
+				const char *name = LUA->IsType( -1, GarrysMod::Lua::Type::String ) ?
+					LUA->GetString( -1 ) : "";
+
+				WritePlayerReplyEntry(
+					packet,
+					written,
+					name,
+					GetNumberField( LUA, -2, "score", 0.0 ),
+					GetNumberField( LUA, -2, "time", 0.0 )
+				);
+				++written;
+
+				LUA->Pop( 1 );
+			}
+
+			LUA->Pop( 1 );
+		}
+
+		WritePlayerReplyCount( packet, written );
+	}
+
+	void WriteRulesReply( bf_write &packet, const std::vector<std::pair<std::string, std::string>> &rules )
+	{
+		packet.WriteLong( -1 ); // connectionless packet header
+		packet.WriteByte( 'E' ); // packet type is always 'E'
+		packet.WriteShort( static_cast<int32_t>( rules.size( ) ) );
+		for( const auto &rule : rules )
+		{
+			packet.WriteString( rule.first.c_str( ) );
+			packet.WriteString( rule.second.c_str( ) );
+		}
+	}
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <GarrysMod/Lua/Interface.h>
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+class bf_write;
+
+namespace netfilter
+{
+	// values our A2S_INFO reply is built from when the hook doesn't override them
+	struct reply_info_t
+	{
+		std::string game_name;
+		std::string map_name;
+		std::string game_dir;
+		std::string gamemode_name;
+		int32_t amt_clients;
+		int32_t max_clients;
+		int32_t amt_bots;
+		char server_type;
+		char os_type;
+		bool passworded;
+		bool secure;
+		std::string game_version;
+		int32_t udp_port;
+		std::string tags;
+		int32_t appid;
+		uint64_t steamid;
+	};
+
+	// byte offsets of the A2S_INFO fields that change while a map is running, so a
+	// written reply can be patched in place instead of rewritten
+	struct info_offsets_t
+	{
+		int32_t amt_clients;
+		int32_t max_clients;
+		int32_t amt_bots;
+		int32_t secure;
+	};
+
+	// A2S replies are serialized straight into the caller's preallocated buffer, values
+	// coming from Lua are written while they're still on the stack so nothing is copied
+	void WriteInfoReply( bf_write &packet, const reply_info_t &info, info_offsets_t *offsets = nullptr );
+
+	// rewrites the fixed size fields of a reply written by WriteInfoReply
+	void PatchInfoReply( bf_write &packet, const info_offsets_t &offsets, const reply_info_t &info );
+
+	// writes the A2S_INFO reply described by the table at index, missing fields are
+	// taken from defaults
+	void WriteInfoReply(
+		bf_write &packet,
+		GarrysMod::Lua::ILuaBase *LUA,
+		int32_t index,
+		const reply_info_t &defaults
+	);
+
+	// A2S_PLAYER replies are a header, the players and then the count patched in
+	void WritePlayerReplyHeader( bf_write &packet );
+	void WritePlayerReplyEntry(
+		bf_write &packet,
+		uint8_t index,
+		const char *name,
+		double score,
+		double time
+	);
+	void WritePlayerReplyCount( bf_write &packet, uint8_t count );
+
+	// writes the A2S_PLAYER reply described by the array of players at index
+	void WritePlayerReply( bf_write &packet, GarrysMod::Lua::ILuaBase *LUA, int32_t index );
+
+	// writes an A2S_RULES reply of name and value pairs
+	void WriteRulesReply( bf_write &packet, const std::vector<std::pair<std::string, std::string>> &rules );
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace netfilter
+{
+	// Immutable object published by a single writer and read lock-free by up to Readers
+	// threads. A reader pins the current epoch while it uses the object it got from
+	// Enter( ), a replaced object is only deleted once every reader has left or entered
+	// a later epoch. Every operation is seq_cst so a reader that pinned after a Publish
+	// can't load the pointer it replaced.
+	template<typename T, size_t Readers>
+	class Snapshot
+	{
+	public:
+		Snapshot( ) :
+			current( nullptr ), epoch( 1 )
+		{
+			for( size_t k = 0; k < Readers; ++k )
+				readers[k].epoch.store( 0 );
+		}
+
+		~Snapshot( )
+		{
+			delete current.load( );
+			for( const auto &r : retired )
+				delete r.first;
+		}
+
+		// reader side, reader is a slot index owned by the calling thread
+
+		const T *Enter( size_t reader )
+		{
+			readers[reader].epoch.store( epoch.load( ) );
+			return current.load( );
+		}
+
+		void Leave( size_t reader )
+		{
+			readers[reader].epoch.store( 0 );
+		}
+
+		// writer side
+
+		void Publish( T *next )
+		{
+			T *previous = current.exchange( next );
+			const uint64_t retired_epoch = epoch.fetch_add( 1 );
+			if( previous != nullptr )
+				retired.emplace_back( previous, retired_epoch );
+
+			Reclaim( );
+		}
+
+		void Reclaim( )
+		{
+			if( retired.empty( ) )
+				return;
+
+			// oldest epoch a reader might still be using an object from
+			uint64_t oldest = UINT64_MAX;
+			for( size_t k = 0; k < Readers; ++k )
+			{
+				const uint64_t e = readers[k].epoch.load( );
+				if( e != 0 && e < oldest )
+					oldest = e;
+			}
+
+			size_t kept = 0;
+			for( size_t k = 0; k < retired.size( ); ++k )
+				if( retired[k].second < oldest )
+					delete retired[k].first;
+				else
+					retired[kept++] = retired[k];
+
+			retired.resize( kept );
+		}
+
+	private:
+		struct alignas( 64 ) reader_t
+		{
+			std::atomic<uint64_t> epoch;
+		};
+
+		std::atomic<T *> current;
+		std::atomic<uint64_t> epoch;
+		reader_t readers[Readers];
+		std::vector<std::pair<T *, uint64_t>> retired;
+	};
+}
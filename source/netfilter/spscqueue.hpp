@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+namespace netfilter
+{
+	// Bounded single producer, single consumer ring. Slots are constructed once and
+	// reused in place, the producer fills Back( ) and publishes it with Push( ), the
+	// consumer reads Front( ) and releases it with Pop( ). Neither side locks.
+	template<typename T, size_t Capacity>
+	class SPSCQueue
+	{
+	public:
+		SPSCQueue( ) :
+			head( 0 ), tail( 0 )
+		{ }
+
+		// producer side
+
+		size_t Space( ) const
+		{
+			return Capacity - ( tail.load( std::memory_order_relaxed ) - head.load( std::memory_order_acquire ) );
+		}
+
+		T &Back( size_t offset = 0 )
+		{
+			return slots[( tail.load( std::memory_order_relaxed ) + offset ) % Capacity];
+		}
+
+		void Push( size_t count = 1 )
+		{
+			tail.store( tail.load( std::memory_order_relaxed ) + count, std::memory_order_release );
+		}
+
+		// consumer side
+
+		bool Empty( ) const
+		{
+			return head.load( std::memory_order_relaxed ) == tail.load( std::memory_order_acquire );
+		}
+
+		T &Front( )
+		{
+			return slots[head.load( std::memory_order_relaxed ) % Capacity];
+		}
+
+		void Pop( )
+		{
+			head.store( head.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+		}
+
+	private:
+		alignas( 64 ) std::atomic<size_t> head;
+		alignas( 64 ) std::atomic<size_t> tail;
+		T slots[Capacity];
+	};
+}
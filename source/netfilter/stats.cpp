@@ -0,0 +1,262 @@
+#include "stats.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace netfilter
+{
+	static const char *stat_names[StatCount] = {
+		"packets_received",
+		"packets_passed",
+		"packets_dropped",
+		"info_queries",
+		"player_queries",
+		"rules_queries",
+		"malformed_packets",
+		"banned_packets",
+		"rate_limited",
+		"challenges_sent",
+		"snapshot_replies",
+		"queued_queries",
+		"query_queue_full",
+		"hook_calls",
+		"replies_sent",
+		"packet_queue_full"
+	};
+
+	static const char *stage_names[StageCount] = {
+		"receive",
+		"classify",
+		"hook",
+		"send"
+	};
+
+	static const char *peak_names[PeakCount] = {
+		"packet_queue_peak",
+		"query_queue_peak"
+	};
+
+	static const char *gauge_names[GaugeCount] = {
+		"clients",
+		"subnets24",
+		"subnets16"
+	};
+
+	static const uint32_t peak_value_bits = 48;
+	static const uint64_t peak_value_mask = ( 1ULL << peak_value_bits ) - 1;
+
+	Histogram::Histogram( ) :
+		sum( 0 )
+	{
+		for( std::atomic<uint64_t> &bucket : buckets )
+			bucket.store( 0, std::memory_order_relaxed );
+	}
+
+	void Histogram::Record( uint64_t value )
+	{
+		std::atomic<uint64_t> &bucket = buckets[GetBucket( value )];
+		bucket.store( bucket.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+		sum.store( sum.load( std::memory_order_relaxed ) + value, std::memory_order_relaxed );
+	}
+
+	uint64_t Histogram::Get( size_t bucket ) const
+	{
+		return buckets[bucket].load( std::memory_order_relaxed );
+	}
+
+	uint64_t Histogram::GetSum( ) const
+	{
+		return sum.load( std::memory_order_relaxed );
+	}
+
+	size_t Histogram::GetBucket( uint64_t value )
+	{
+		if( value < SubBuckets )
+			return static_cast<size_t>( value );
+
+		uint32_t magnitude = 63;
+		while( ( value >> magnitude ) == 0 )
+			--magnitude;
+
+		const uint64_t sub = ( value >> ( magnitude - SubBucketBits ) ) & ( SubBuckets - 1 );
+		const size_t bucket = ( magnitude - SubBucketBits + 1 ) * SubBuckets + sub;
+		return bucket < Buckets ? bucket : Buckets - 1;
+	}
+
+	uint64_t Histogram::GetBucketValue( size_t bucket )
+	{
+		if( bucket < SubBuckets )
+			return bucket;
+
+		// middle of the bucket
+		const uint32_t shift = static_cast<uint32_t>( bucket / SubBuckets ) - 1;
+		const uint64_t lower = static_cast<uint64_t>( SubBuckets + bucket % SubBuckets ) << shift;
+		return lower + ( ( 1ULL << shift ) >> 1 );
+	}
+
+	ThreadStats::ThreadStats( ) :
+		epochs( nullptr )
+	{
+		for( std::atomic<uint64_t> &counter : counters )
+			counter.store( 0, std::memory_order_relaxed );
+
+		for( auto &window : peaks )
+			for( std::atomic<uint64_t> &peak : window )
+				peak.store( 0, std::memory_order_relaxed );
+
+		for( std::atomic<uint64_t> &gauge : gauges )
+			gauge.store( 0, std::memory_order_relaxed );
+	}
+
+	void ThreadStats::Observe( Peak peak, uint64_t value )
+	{
+		value &= peak_value_mask;
+		for( size_t w = 0; w < PeakWindowCount; ++w )
+		{
+			const uint64_t epoch = static_cast<uint64_t>(
+				epochs[w].load( std::memory_order_relaxed ) & 0xFFFF
+			) << peak_value_bits;
+			std::atomic<uint64_t> &current = peaks[w][static_cast<size_t>( peak )];
+			const uint64_t previous = current.load( std::memory_order_relaxed );
+			if( ( previous & ~peak_value_mask ) != epoch || ( previous & peak_value_mask ) < value )
+				current.store( epoch | value, std::memory_order_relaxed );
+		}
+	}
+
+	void stats_snapshot_t::Subtract( const stats_snapshot_t &other )
+	{
+		for( size_t k = 0; k < StatCount; ++k )
+			counters[k] -= other.counters[k];
+
+		for( size_t s = 0; s < StageCount; ++s )
+		{
+			for( size_t k = 0; k < Histogram::Buckets; ++k )
+				buckets[s][k] -= other.buckets[s][k];
+
+			sums[s] -= other.sums[s];
+		}
+	}
+
+	uint64_t stats_snapshot_t::GetCount( Stage stage ) const
+	{
+		uint64_t total = 0;
+		for( const uint64_t value : buckets[static_cast<size_t>( stage )] )
+			total += value;
+
+		return total;
+	}
+
+	uint64_t stats_snapshot_t::GetPercentile( Stage stage, double percentile ) const
+	{
+		const uint64_t total = GetCount( stage );
+		if( total == 0 )
+			return 0;
+
+		uint64_t target = static_cast<uint64_t>( static_cast<double>( total ) * percentile );
+		if( target == 0 )
+			target = 1;
+
+		uint64_t seen = 0;
+		const uint64_t *values = buckets[static_cast<size_t>( stage )];
+		for( size_t k = 0; k < Histogram::Buckets; ++k )
+		{
+			seen += values[k];
+			if( seen >= target )
+				return Histogram::GetBucketValue( k );
+		}
+
+		return Histogram::GetBucketValue( Histogram::Buckets - 1 );
+	}
+
+	StatsRegistry::StatsRegistry( size_t threads ) :
+		count( threads ), threads( new ThreadStats[threads] ), baseline( new stats_snapshot_t( ) )
+	{
+		for( std::atomic<uint32_t> &epoch : epochs )
+			epoch.store( 0, std::memory_order_relaxed );
+
+		for( size_t t = 0; t < count; ++t )
+			this->threads[t].epochs = epochs;
+	}
+
+	ThreadStats &StatsRegistry::Get( size_t thread )
+	{
+		return threads[thread];
+	}
+
+	void StatsRegistry::Collect( stats_snapshot_t &snapshot, bool since_reset ) const
+	{
+		std::memset( &snapshot, 0, sizeof( snapshot ) );
+		CollectPeaks( PeakWindow::Reset, snapshot.peaks );
+		for( size_t t = 0; t < count; ++t )
+		{
+			const ThreadStats &stats = threads[t];
+			for( size_t k = 0; k < StatCount; ++k )
+				snapshot.counters[k] += stats.counters[k].load( std::memory_order_relaxed );
+
+			for( size_t k = 0; k < GaugeCount; ++k )
+				snapshot.gauges[k] += stats.gauges[k].load( std::memory_order_relaxed );
+
+			for( size_t s = 0; s < StageCount; ++s )
+			{
+				const Histogram &histogram = stats.histograms[s];
+				for( size_t k = 0; k < Histogram::Buckets; ++k )
+					snapshot.buckets[s][k] += histogram.Get( k );
+
+				snapshot.sums[s] += histogram.GetSum( );
+			}
+		}
+
+		if( since_reset )
+			snapshot.Subtract( *baseline );
+	}
+
+	void StatsRegistry::Reset( )
+	{
+		Collect( *baseline, false );
+		epochs[static_cast<size_t>( PeakWindow::Reset )].fetch_add( 1, std::memory_order_relaxed );
+	}
+
+	void StatsRegistry::CollectExportPeaks( uint64_t ( &peaks )[PeakCount] )
+	{
+		CollectPeaks( PeakWindow::Export, peaks );
+		epochs[static_cast<size_t>( PeakWindow::Export )].fetch_add( 1, std::memory_order_relaxed );
+	}
+
+	void StatsRegistry::CollectPeaks( PeakWindow window, uint64_t ( &peaks )[PeakCount] ) const
+	{
+		const size_t w = static_cast<size_t>( window );
+		const uint64_t current = static_cast<uint64_t>(
+			epochs[w].load( std::memory_order_relaxed ) & 0xFFFF
+		) << peak_value_bits;
+		for( uint64_t &peak : peaks )
+			peak = 0;
+
+		for( size_t t = 0; t < count; ++t )
+			for( size_t k = 0; k < PeakCount; ++k )
+			{
+				const uint64_t peak = threads[t].peaks[w][k].load( std::memory_order_relaxed );
+				if( ( peak & ~peak_value_mask ) == current )
+					peaks[k] = std::max( peaks[k], peak & peak_value_mask );
+			}
+	}
+
+	const char *StatsRegistry::GetName( Stat stat )
+	{
+		return stat_names[static_cast<size_t>( stat )];
+	}
+
+	const char *StatsRegistry::GetName( Stage stage )
+	{
+		return stage_names[static_cast<size_t>( stage )];
+	}
+
+	const char *StatsRegistry::GetName( Peak peak )
+	{
+		return peak_names[static_cast<size_t>( peak )];
+	}
+
+	const char *StatsRegistry::GetName( Gauge gauge )
+	{
+		return gauge_names[static_cast<size_t>( gauge )];
+	}
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace netfilter
+{
+	enum class Stat
+	{
+		PacketsReceived,
+		PacketsPassed,
+		PacketsDropped,
+		InfoQueries,
+		PlayerQueries,
+		RulesQueries,
+		MalformedPackets,
+		BannedPackets,
+		RateLimited,
+		ChallengesSent,
+		SnapshotReplies,
+		QueuedQueries,
+		QueryQueueFull,
+		HookCalls,
+		RepliesSent,
+		PacketQueueFull
+	};
+
+	static const size_t StatCount = 16;
+
+	enum class Stage
+	{
+		Receive,
+		Classify,
+		Hook,
+		Send
+	};
+
+	static const size_t StageCount = 4;
+
+	// queue depth high-water marks
+	enum class Peak
+	{
+		PacketQueue,
+		QueryQueue
+	};
+
+	static const size_t PeakCount = 2;
+
+	// peaks are tracked since the last ResetStats from Lua and, separately, since the
+	// exporter's previous push
+	enum class PeakWindow
+	{
+		Reset,
+		Export
+	};
+
+	static const size_t PeakWindowCount = 2;
+
+	// current values owned by a thread, summed over every thread
+	enum class Gauge
+	{
+		Clients,
+		Subnets24,
+		Subnets16
+	};
+
+	static const size_t GaugeCount = 3;
+
+	// log-linear histogram of nanoseconds, 8 linear buckets per power of two so any
+	// recorded value is known within 12.5%
+	class Histogram
+	{
+	public:
+		Histogram( );
+
+		void Record( uint64_t value );
+		uint64_t Get( size_t bucket ) const;
+		uint64_t GetSum( ) const;
+
+		static size_t GetBucket( uint64_t value );
+		static uint64_t GetBucketValue( size_t bucket );
+
+		static const uint32_t SubBucketBits = 3;
+		static const uint32_t SubBuckets = 1 << SubBucketBits;
+		static const uint32_t Buckets = 32 * SubBuckets;
+
+	private:
+		std::atomic<uint64_t> buckets[Buckets];
+		std::atomic<uint64_t> sum;
+	};
+
+	// written by a single thread without read-modify-write atomics, read by any thread
+	struct alignas( 64 ) ThreadStats
+	{
+		ThreadStats( );
+
+		void Add( Stat stat, uint64_t count = 1 )
+		{
+			std::atomic<uint64_t> &counter = counters[static_cast<size_t>( stat )];
+			counter.store( counter.load( std::memory_order_relaxed ) + count, std::memory_order_relaxed );
+		}
+
+		void Record( Stage stage, uint64_t nanoseconds )
+		{
+			histograms[static_cast<size_t>( stage )].Record( nanoseconds );
+		}
+
+		void Observe( Peak peak, uint64_t value );
+
+		void Set( Gauge gauge, uint64_t value )
+		{
+			gauges[static_cast<size_t>( gauge )].store( value, std::memory_order_relaxed );
+		}
+
+		std::atomic<uint64_t> counters[StatCount];
+		Histogram histograms[StageCount];
+
+		// window epoch in the upper 16 bits, peaks from older epochs count as 0
+		std::atomic<uint64_t> peaks[PeakWindowCount][PeakCount];
+		const std::atomic<uint32_t> *epochs;
+		std::atomic<uint64_t> gauges[GaugeCount];
+	};
+
+	// every thread's stats summed up
+	struct stats_snapshot_t
+	{
+		uint64_t counters[StatCount];
+		uint64_t buckets[StageCount][Histogram::Buckets];
+		uint64_t sums[StageCount];
+		uint64_t peaks[PeakCount];
+		uint64_t gauges[GaugeCount];
+
+		// counters and histograms only, peaks and gauges are kept
+		void Subtract( const stats_snapshot_t &other );
+
+		uint64_t GetCount( Stage stage ) const;
+		uint64_t GetPercentile( Stage stage, double percentile ) const;
+	};
+
+	class StatsRegistry
+	{
+	public:
+		StatsRegistry( size_t threads );
+
+		ThreadStats &Get( size_t thread );
+
+		// since_reset subtracts what was collected by the last Reset (main thread only),
+		// peaks are always the highest values since the last Reset
+		void Collect( stats_snapshot_t &snapshot, bool since_reset ) const;
+		void Reset( );
+		// highest values since the previous call, which starts a new window (exporter only)
+		void CollectExportPeaks( uint64_t ( &peaks )[PeakCount] );
+
+		static const char *GetName( Stat stat );
+		static const char *GetName( Stage stage );
+		static const char *GetName( Peak peak );
+		static const char *GetName( Gauge gauge );
+
+	private:
+		void CollectPeaks( PeakWindow window, uint64_t ( &peaks )[PeakCount] ) const;
+
+		size_t count;
+		std::atomic<uint32_t> epochs[PeakWindowCount];
+		std::unique_ptr<ThreadStats[]> threads;
+		std::unique_ptr<stats_snapshot_t> baseline;
+	};
+}